@@ -0,0 +1,147 @@
+#include "acpi.h"
+#include "limine.h"
+#include "pmm.h"
+#include "vmm.h"
+#include "utils.h"
+#include "display.h"
+
+__attribute__((used, section(".limine_requests")))
+static volatile struct limine_rsdp_request rsdp_request = {
+    .id = LIMINE_RSDP_REQUEST_ID,
+    .revision = 0,
+    .response = NULL
+};
+
+static AcpiHeader* root;
+// XSDT entries are 64 bit, RSDT entries 32 bit
+static u32 entry_size;
+static MadtInfo madt;
+static bool madt_valid;
+
+static bool checksum_ok(void* table, u64 length) {
+    u8 sum = 0;
+    for (u64 i = 0; i < length; i++) {
+        sum += ((u8*)table)[i];
+    }
+    return sum == 0;
+}
+
+// Tables usually live in ACPI memory the direct map already covers, but the
+// RSDP can sit in the BIOS area outside the memmap
+static AcpiHeader* map_table(u64 phys) {
+    AcpiHeader* header = vmm_map_physical(phys, sizeof(AcpiHeader), PTE_CACHE_WB);
+    if (header == NULL || vmm_map_physical(phys, header->length, PTE_CACHE_WB) == NULL) {
+        return NULL;
+    }
+    if (!checksum_ok(header, header->length)) {
+        return NULL;
+    }
+    return header;
+}
+
+AcpiHeader* acpi_find_table(const char* signature) {
+    if (root == NULL) {
+        return NULL;
+    }
+    u64 count = (root->length - sizeof(AcpiHeader)) / entry_size;
+    u8* entries = (u8*)root + sizeof(AcpiHeader);
+    for (u64 i = 0; i < count; i++) {
+        u64 phys = entry_size == 8 ? *(u64*)(entries + i * 8) : *(u32*)(entries + i * 4);
+        AcpiHeader* header = vmm_map_physical(phys, sizeof(AcpiHeader), PTE_CACHE_WB);
+        if (header != NULL && memcmp(header->signature, signature, 4) == 0) {
+            return map_table(phys);
+        }
+    }
+    return NULL;
+}
+
+static void parse_madt(AcpiMadt* table) {
+    madt.lapic_address = table->lapic_address;
+    madt.has_pic = (table->flags & MADT_PCAT_COMPAT) != 0;
+    for (u32 irq = 0; irq < ISA_IRQS; irq++) {
+        madt.isa_irqs[irq] = (IsaIrq){irq, false, false};
+    }
+
+    u8* entry = table->entries;
+    u8* end = (u8*)table + table->header.length;
+    while (entry + 2 <= end && entry[1] >= 2 && entry + entry[1] <= end) {
+        switch (entry[0]) {
+        case MADT_LAPIC: {
+            u32 flags = *(u32*)(entry + 4);
+            if ((flags & (MADT_CPU_ENABLED | MADT_CPU_ONLINE_CAPABLE)) && madt.cpu_count < MAX_CPUS) {
+                madt.apic_ids[madt.cpu_count++] = entry[3];
+            }
+            break;
+        }
+        case MADT_X2APIC: {
+            u32 flags = *(u32*)(entry + 8);
+            if ((flags & (MADT_CPU_ENABLED | MADT_CPU_ONLINE_CAPABLE)) && madt.cpu_count < MAX_CPUS) {
+                madt.apic_ids[madt.cpu_count++] = *(u32*)(entry + 4);
+            }
+            break;
+        }
+        case MADT_IOAPIC:
+            if (madt.ioapic_count < MAX_IOAPICS) {
+                madt.ioapics[madt.ioapic_count++] = (IoApicInfo){
+                    .id = entry[2],
+                    .address = *(u32*)(entry + 4),
+                    .gsi_base = *(u32*)(entry + 8)
+                };
+            }
+            break;
+        case MADT_ISO: {
+            u8 source = entry[3];
+            u16 flags = *(u16*)(entry + 8);
+            if (source < ISA_IRQS) {
+                // "conforms to the bus" means edge triggered and active high for ISA
+                madt.isa_irqs[source] = (IsaIrq){
+                    .gsi = *(u32*)(entry + 4),
+                    .active_low = (flags & MADT_POLARITY_MASK) == MADT_POLARITY_LOW,
+                    .level = (flags & MADT_TRIGGER_MASK) == MADT_TRIGGER_LEVEL
+                };
+            }
+            break;
+        }
+        case MADT_LAPIC_ADDRESS:
+            madt.lapic_address = *(u64*)(entry + 4);
+            break;
+        }
+        entry += entry[1];
+    }
+    madt_valid = madt.ioapic_count > 0;
+}
+
+bool init_acpi() {
+    if (rsdp_request.response == NULL) {
+        return false;
+    }
+    // a physical address since base revision 3
+    u64 rsdp_phys = (u64)rsdp_request.response->address;
+    AcpiRsdp* rsdp = vmm_map_physical(rsdp_phys, sizeof(AcpiRsdp), PTE_CACHE_WB);
+    if (rsdp == NULL || memcmp(rsdp->signature, "RSD PTR ", 8) != 0 || !checksum_ok(rsdp, 20)) {
+        print_err(str8_lit("acpi: bad RSDP\n"));
+        return false;
+    }
+
+    if (rsdp->revision >= 2 && rsdp->xsdt_address != 0) {
+        root = map_table(rsdp->xsdt_address);
+        entry_size = 8;
+    } else {
+        root = map_table(rsdp->rsdt_address);
+        entry_size = 4;
+    }
+    if (root == NULL) {
+        print_err(str8_lit("acpi: bad root table\n"));
+        return false;
+    }
+
+    AcpiMadt* table = (AcpiMadt*)acpi_find_table("APIC");
+    if (table != NULL) {
+        parse_madt(table);
+    }
+    return true;
+}
+
+MadtInfo* acpi_madt() {
+    return madt_valid ? &madt : NULL;
+}
@@ -0,0 +1,89 @@
+#pragma once
+
+#include "types.h"
+#include "cpu.h"
+#include <stdbool.h>
+
+typedef struct __attribute__((packed)) AcpiRsdp {
+    char signature[8];
+    u8 checksum;
+    char oem_id[6];
+    u8 revision;
+    u32 rsdt_address;
+    // ACPI 2.0+
+    u32 length;
+    u64 xsdt_address;
+    u8 extended_checksum;
+    u8 reserved[3];
+} AcpiRsdp;
+
+typedef struct __attribute__((packed)) AcpiHeader {
+    char signature[4];
+    u32 length;
+    u8 revision;
+    u8 checksum;
+    char oem_id[6];
+    char oem_table_id[8];
+    u32 oem_revision;
+    u32 creator_id;
+    u32 creator_revision;
+} AcpiHeader;
+
+typedef struct __attribute__((packed)) AcpiMadt {
+    AcpiHeader header;
+    u32 lapic_address;
+    u32 flags;
+    u8 entries[];
+} AcpiMadt;
+
+#define MADT_PCAT_COMPAT (1 << 0)
+
+#define MADT_LAPIC 0
+#define MADT_IOAPIC 1
+#define MADT_ISO 2
+#define MADT_LAPIC_ADDRESS 5
+#define MADT_X2APIC 9
+
+#define MADT_CPU_ENABLED (1 << 0)
+#define MADT_CPU_ONLINE_CAPABLE (1 << 1)
+
+// MPS INTI flags of an interrupt source override
+#define MADT_POLARITY_MASK 0x3
+#define MADT_POLARITY_LOW 0x3
+#define MADT_TRIGGER_MASK 0xc
+#define MADT_TRIGGER_LEVEL 0xc
+
+#define MAX_IOAPICS 8
+#define ISA_IRQS 16
+
+typedef struct IoApicInfo {
+    u32 id;
+    u64 address;
+    u32 gsi_base;
+} IoApicInfo;
+
+// Where an ISA IRQ ends up, identity mapped and edge/active high unless the MADT overrides it
+typedef struct IsaIrq {
+    u32 gsi;
+    bool active_low;
+    bool level;
+} IsaIrq;
+
+typedef struct MadtInfo {
+    u64 lapic_address;
+    bool has_pic;
+    u32 cpu_count;
+    u32 apic_ids[MAX_CPUS];
+    u32 ioapic_count;
+    IoApicInfo ioapics[MAX_IOAPICS];
+    IsaIrq isa_irqs[ISA_IRQS];
+} MadtInfo;
+
+// Returns false if the bootloader found no RSDP or the tables are broken
+bool init_acpi();
+
+// signature is the 4 character table signature, e.g. "APIC"
+AcpiHeader* acpi_find_table(const char* signature);
+
+// NULL without a usable MADT
+MadtInfo* acpi_madt();
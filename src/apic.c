@@ -0,0 +1,216 @@
+#include "apic.h"
+#include "acpi.h"
+#include "cpu.h"
+#include "vmm.h"
+#include "pmm.h"
+#include "interrupt.h"
+#include "display.h"
+#include "utils.h"
+
+#define MSR_APIC_BASE 0x1b
+#define APIC_BASE_X2APIC (1 << 10)
+#define APIC_BASE_ENABLE (1 << 11)
+// x2APIC registers are MSRs at 0x800 + (xAPIC offset >> 4)
+#define MSR_X2APIC 0x800
+
+#define IOAPIC_VERSION 0x01
+#define IOAPIC_REDIRECTION(pin) (0x10 + 2 * (pin))
+
+#define REDIRECTION_ACTIVE_LOW (1 << 13)
+#define REDIRECTION_LEVEL (1 << 15)
+#define REDIRECTION_MASKED (1 << 16)
+
+typedef struct IoApic {
+    // index register at offset 0, data window at offset 0x10
+    volatile u32* base;
+    u32 gsi_base;
+    u32 pins;
+} IoApic;
+
+static bool enabled;
+static bool x2apic;
+static volatile u8* lapic_base;
+static IoApic ioapics[MAX_IOAPICS];
+static u32 ioapic_count;
+
+u32 lapic_read(u32 reg) {
+    if (x2apic) {
+        return (u32)rdmsr(MSR_X2APIC + (reg >> 4));
+    }
+    return *(volatile u32*)(lapic_base + reg);
+}
+
+void lapic_write(u32 reg, u32 value) {
+    if (x2apic) {
+        wrmsr(MSR_X2APIC + (reg >> 4), value);
+    } else {
+        *(volatile u32*)(lapic_base + reg) = value;
+    }
+}
+
+void lapic_eoi() {
+    lapic_write(LAPIC_EOI, 0);
+}
+
+u32 lapic_id() {
+    u32 id = lapic_read(LAPIC_ID);
+    return x2apic ? id : id >> 24;
+}
+
+void lapic_send_ipi(u32 apic_id, u8 vector) {
+    if (x2apic) {
+        // the ICR is one 64 bit MSR in x2APIC mode and has no delivery status
+        wrmsr(MSR_X2APIC + (LAPIC_ICR >> 4), ((u64)apic_id << 32) | vector);
+        return;
+    }
+
+    u64 flags = irq_save();
+    while (lapic_read(LAPIC_ICR) & ICR_PENDING) {
+        cpu_relax();
+    }
+    lapic_write(LAPIC_ICR_HIGH, apic_id << 24);
+    lapic_write(LAPIC_ICR, vector);
+    irq_restore(flags);
+}
+
+static u32 ioapic_read(IoApic* ioapic, u32 reg) {
+    ioapic->base[0] = reg;
+    return ioapic->base[4];
+}
+
+static void ioapic_write(IoApic* ioapic, u32 reg, u32 value) {
+    ioapic->base[0] = reg;
+    ioapic->base[4] = value;
+}
+
+static IoApic* ioapic_for_irq(u8 irq, u32* pin) {
+    u32 gsi = irq < ISA_IRQS ? acpi_madt()->isa_irqs[irq].gsi : irq;
+    for (u32 i = 0; i < ioapic_count; i++) {
+        if (gsi >= ioapics[i].gsi_base && gsi < ioapics[i].gsi_base + ioapics[i].pins) {
+            *pin = gsi - ioapics[i].gsi_base;
+            return &ioapics[i];
+        }
+    }
+    return NULL;
+}
+
+bool ioapic_route_irq(u8 irq, u8 vector, u32 apic_id) {
+    u32 pin;
+    IoApic* ioapic = ioapic_for_irq(irq, &pin);
+    // without interrupt remapping the destination field only holds 8 bits
+    if (ioapic == NULL || apic_id > 0xff) {
+        return false;
+    }
+
+    u64 entry = vector | ((u64)apic_id << 56);
+    if (irq < ISA_IRQS) {
+        IsaIrq isa = acpi_madt()->isa_irqs[irq];
+        if (isa.active_low) {
+            entry |= REDIRECTION_ACTIVE_LOW;
+        }
+        if (isa.level) {
+            entry |= REDIRECTION_LEVEL;
+        }
+    }
+
+    u64 flags = irq_save();
+    ioapic_write(ioapic, IOAPIC_REDIRECTION(pin) + 1, entry >> 32);
+    ioapic_write(ioapic, IOAPIC_REDIRECTION(pin), (u32)entry);
+    irq_restore(flags);
+    return true;
+}
+
+static void ioapic_set_masked(u8 irq, bool masked) {
+    u32 pin;
+    IoApic* ioapic = ioapic_for_irq(irq, &pin);
+    if (ioapic == NULL) {
+        return;
+    }
+
+    u64 flags = irq_save();
+    u32 low = ioapic_read(ioapic, IOAPIC_REDIRECTION(pin));
+    low = masked ? low | REDIRECTION_MASKED : low & ~(u32)REDIRECTION_MASKED;
+    ioapic_write(ioapic, IOAPIC_REDIRECTION(pin), low);
+    irq_restore(flags);
+}
+
+void ioapic_mask_irq(u8 irq) {
+    ioapic_set_masked(irq, true);
+}
+
+void ioapic_unmask_irq(u8 irq) {
+    ioapic_set_masked(irq, false);
+}
+
+// Must not send an EOI, spurious interrupts don't set an in-service bit
+static void spurious_interrupt_handler(TrapFrame* frame) {
+    (void)frame;
+}
+
+void init_lapic_cpu() {
+    u64 base = rdmsr(MSR_APIC_BASE) | APIC_BASE_ENABLE;
+    if (x2apic) {
+        base |= APIC_BASE_X2APIC;
+    }
+    wrmsr(MSR_APIC_BASE, base);
+
+    lapic_write(LAPIC_TPR, 0);
+    lapic_write(LAPIC_LVT_TIMER, LVT_MASKED);
+    lapic_write(LAPIC_LVT_ERROR, LVT_MASKED);
+    // LINT0 (the 8259 as ExtINT) and LINT1 (NMI) stay as the firmware set them up
+    lapic_write(LAPIC_SVR, LAPIC_SVR_ENABLE | SPURIOUS_VECTOR);
+}
+
+bool init_apic() {
+    MadtInfo* madt = acpi_madt();
+    u32 eax, ebx, ecx, edx;
+    cpuid(1, 0, &eax, &ebx, &ecx, &edx);
+    if (madt == NULL || (edx & (1 << 9)) == 0) {
+        return false;
+    }
+
+    x2apic = (ecx & (1 << 21)) != 0;
+    if (!x2apic) {
+        lapic_base = vmm_map_physical(madt->lapic_address, PAGE_SIZE, PTE_CACHE_UC);
+        if (lapic_base == NULL) {
+            return false;
+        }
+    }
+
+    for (u32 i = 0; i < madt->ioapic_count; i++) {
+        IoApic* ioapic = &ioapics[ioapic_count];
+        ioapic->base = vmm_map_physical(madt->ioapics[i].address, PAGE_SIZE, PTE_CACHE_UC);
+        if (ioapic->base == NULL) {
+            continue;
+        }
+        ioapic->gsi_base = madt->ioapics[i].gsi_base;
+        ioapic->pins = ((ioapic_read(ioapic, IOAPIC_VERSION) >> 16) & 0xff) + 1;
+        for (u32 pin = 0; pin < ioapic->pins; pin++) {
+            ioapic_write(ioapic, IOAPIC_REDIRECTION(pin), REDIRECTION_MASKED);
+        }
+        ioapic_count++;
+    }
+    if (ioapic_count == 0) {
+        return false;
+    }
+
+    set_interrupt_handler(SPURIOUS_VECTOR, spurious_interrupt_handler);
+    init_lapic_cpu();
+    enabled = true;
+
+    print(x2apic ? str8_lit("apic: x2apic") : str8_lit("apic: xapic"));
+    print(str8_lit(", cpus="));
+    print_u64(madt->cpu_count);
+    print(str8_lit(" ioapics="));
+    print_u64(ioapic_count);
+    print(str8_lit("\n"));
+    return true;
+}
+
+bool apic_enabled() {
+    return enabled;
+}
+
+bool apic_x2apic() {
+    return x2apic;
+}
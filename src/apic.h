@@ -0,0 +1,55 @@
+#pragma once
+
+#include "types.h"
+#include <stdbool.h>
+
+#define LAPIC_ID 0x20
+#define LAPIC_VERSION 0x30
+#define LAPIC_TPR 0x80
+#define LAPIC_EOI 0xb0
+#define LAPIC_SVR 0xf0
+#define LAPIC_ESR 0x280
+#define LAPIC_ICR 0x300
+#define LAPIC_ICR_HIGH 0x310
+#define LAPIC_LVT_TIMER 0x320
+#define LAPIC_LVT_LINT0 0x350
+#define LAPIC_LVT_LINT1 0x360
+#define LAPIC_LVT_ERROR 0x370
+#define LAPIC_TIMER_INITIAL 0x380
+#define LAPIC_TIMER_CURRENT 0x390
+#define LAPIC_TIMER_DIVIDE 0x3e0
+
+#define LAPIC_SVR_ENABLE (1 << 8)
+#define LVT_MASKED (1 << 16)
+#define ICR_PENDING (1 << 12)
+
+#define SPURIOUS_VECTOR 0xff
+
+// Brings up the BSP's local APIC and the IOAPICs from the MADT. Returns false,
+// leaving everything untouched, when there is no MADT to route interrupts with.
+bool init_apic();
+
+// Has to run on every CPU
+void init_lapic_cpu();
+
+bool apic_enabled();
+
+bool apic_x2apic();
+
+u32 lapic_read(u32 reg);
+
+void lapic_write(u32 reg, u32 value);
+
+// A single register write
+void lapic_eoi();
+
+u32 lapic_id();
+
+void lapic_send_ipi(u32 apic_id, u8 vector);
+
+// Delivers ISA IRQ irq as vector to the CPU with the given APIC id, applying the MADT overrides
+bool ioapic_route_irq(u8 irq, u8 vector, u32 apic_id);
+
+void ioapic_mask_irq(u8 irq);
+
+void ioapic_unmask_irq(u8 irq);
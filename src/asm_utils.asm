@@ -2,6 +2,12 @@ global setGdt
 global reloadSegments
 global setTSS
 global setIdt
+global apEntry
+global switchContext
+global interruptStubs
+
+extern ap_main
+extern interrupt_dispatch
 
 section .data
 gdtr dw 0 ; limit
@@ -22,8 +28,7 @@ reloadSegments:
     mov ax, 0x10 ; 0x10 is the offset in the GDT to the data segment
     mov ds, ax ; Load all data segment selectors
     mov es, ax
-    mov fs, ax
-    mov gs, ax
+    ; not fs and gs, loading them clears the base MSRs and gs points at the per-CPU area
     mov ss, ax
     push 0x08 ; 0x08 is the offset to the code segment
     lea rax, [rel .flush]
@@ -42,3 +47,99 @@ setIdt:
     mov [idtr+2], rsi
     lidt [idtr]
     ret
+
+; Limine starts the APs here with their limine_mp_info in rdi. Its extra_argument
+; (offset 24) is the top of the stack init_smp allocated for this AP.
+apEntry:
+    mov rsp, [rdi + 24]
+    xor rbp, rbp
+    call ap_main
+.halt:
+    cli
+    hlt
+    jmp .halt
+
+; switchContext(u64* save_rsp, u64 next_rsp): the System V ABI lets callers assume
+; only rbx, rbp and r12-r15 survive a call, so those are all a switch has to save.
+; The next thread's stack holds the same six registers and then its return address.
+switchContext:
+    push rbx
+    push rbp
+    push r12
+    push r13
+    push r14
+    push r15
+    mov [rdi], rsp
+    mov rsp, rsi
+    pop r15
+    pop r14
+    pop r13
+    pop r12
+    pop rbp
+    pop rbx
+    ret
+
+; One entry stub per vector. The CPU pushes an error code for 8, 10-14, 17, 21, 29
+; and 30, the others push a zero in its place, so every vector leaves the same
+; TrapFrame (interrupt.h) behind. Each stub is 16 bytes apart.
+%assign vector 0
+%rep 256
+align 16
+interruptStub%+vector:
+%if vector == 8 || (vector >= 10 && vector <= 14) || vector == 17 || vector == 21 || vector == 29 || vector == 30
+%else
+    push 0
+%endif
+    push vector
+    jmp interruptCommon
+%assign vector vector+1
+%endrep
+
+; The CPU aligns rsp to 16 before its 5 qwords, the stub adds 2, and with the 15
+; registers here rsp is a multiple of 16 again for the call.
+interruptCommon:
+    push rax
+    push rbx
+    push rcx
+    push rdx
+    push rsi
+    push rdi
+    push rbp
+    push r8
+    push r9
+    push r10
+    push r11
+    push r12
+    push r13
+    push r14
+    push r15
+    mov rdi, rsp
+    cld
+    call interrupt_dispatch
+    pop r15
+    pop r14
+    pop r13
+    pop r12
+    pop r11
+    pop r10
+    pop r9
+    pop r8
+    pop rbp
+    pop rdi
+    pop rsi
+    pop rdx
+    pop rcx
+    pop rbx
+    pop rax
+    ; vector and error code
+    add rsp, 16
+    iretq
+
+section .rodata
+; entry addresses for the IDT, indexed by vector
+interruptStubs:
+%assign vector 0
+%rep 256
+    dq interruptStub%+vector
+%assign vector vector+1
+%endrep
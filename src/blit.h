@@ -0,0 +1,7 @@
+#pragma once
+
+#include "types.h"
+
+// Copies with 16 byte non-temporal stores, for destinations like the framebuffer
+// that are never read back. Has to run between kernel_fpu_begin/end.
+void blit_stream(void* dest, const void* src, u64 n);
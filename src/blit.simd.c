@@ -0,0 +1,40 @@
+#include "blit.h"
+
+typedef long long v2di __attribute__((vector_size(16)));
+typedef long long v2di_unaligned __attribute__((vector_size(16), aligned(1)));
+
+void blit_stream(void* dest, const void* src, u64 n) {
+    u8* d = dest;
+    const u8* s = src;
+
+    // movntdq needs an aligned destination, the loads can be unaligned
+    while (n > 0 && ((u64)d & 15) != 0) {
+        *d++ = *s++;
+        n--;
+    }
+    while (n >= 64) {
+        v2di a = *(const v2di_unaligned*)s;
+        v2di b = *((const v2di_unaligned*)s + 1);
+        v2di c = *((const v2di_unaligned*)s + 2);
+        v2di e = *((const v2di_unaligned*)s + 3);
+        __builtin_ia32_movntdq((v2di*)d, a);
+        __builtin_ia32_movntdq((v2di*)d + 1, b);
+        __builtin_ia32_movntdq((v2di*)d + 2, c);
+        __builtin_ia32_movntdq((v2di*)d + 3, e);
+        d += 64;
+        s += 64;
+        n -= 64;
+    }
+    while (n >= 16) {
+        __builtin_ia32_movntdq((v2di*)d, *(const v2di_unaligned*)s);
+        d += 16;
+        s += 16;
+        n -= 16;
+    }
+    while (n > 0) {
+        *d++ = *s++;
+        n--;
+    }
+    // non-temporal stores are weakly ordered
+    __builtin_ia32_sfence();
+}
@@ -0,0 +1,131 @@
+#include "clockevent.h"
+#include "apic.h"
+#include "cpu.h"
+#include "percpu.h"
+#include "interrupt.h"
+#include "utils.h"
+#include "time.h"
+
+#define MSR_TSC_DEADLINE 0x6e0
+#define LVT_TIMER_TSC_DEADLINE (2 << 17)
+#define LAPIC_DIVIDE_16 0x3
+
+#define CALIBRATION_MS 10
+
+#define NO_DEADLINE ((u64)-1)
+
+typedef enum ClockeventMode {
+    CLOCKEVENT_NONE,
+    CLOCKEVENT_TSC_DEADLINE,
+    CLOCKEVENT_LAPIC_ONESHOT,
+} ClockeventMode;
+
+static ClockeventMode mode = CLOCKEVENT_NONE;
+// LAPIC timer ticks per millisecond, at divide by 16
+static u64 lapic_khz;
+// TSC deadline programmed on this CPU
+PERCPU static u64 armed;
+PERCPU static u64 interrupts;
+
+// LAPIC timer ticks in CALIBRATION_MS, measured with the already calibrated TSC
+static u64 lapic_window() {
+    u64 cycles = ns_to_cycles(CALIBRATION_MS * NS_PER_MS);
+    lapic_write(LAPIC_TIMER_INITIAL, 0xffffffff);
+    u32 lapic_start = lapic_read(LAPIC_TIMER_CURRENT);
+    u64 start = rdtsc();
+    while (rdtsc() - start < cycles) {
+        cpu_relax();
+    }
+    u64 ticks = lapic_start - lapic_read(LAPIC_TIMER_CURRENT);
+    lapic_write(LAPIC_TIMER_INITIAL, 0);
+    return ticks;
+}
+
+static void program(u64 deadline) {
+    if (mode == CLOCKEVENT_TSC_DEADLINE) {
+        wrmsr(MSR_TSC_DEADLINE, deadline);
+        return;
+    }
+
+    u64 now = rdtsc();
+    u64 count = 1;
+    if (deadline > now) {
+        // rounded up, firing early would only cost another interrupt
+        count = cycles_to_ns(deadline - now) * lapic_khz / NS_PER_MS + 1;
+    }
+    lapic_write(LAPIC_TIMER_INITIAL, count > 0xffffffff ? 0xffffffff : count);
+}
+
+static void clockevent_interrupt_handler(TrapFrame* frame) {
+    (void)frame;
+    u64 deadline = this_cpu_read(armed);
+    if (deadline != NO_DEADLINE && rdtsc() < deadline) {
+        // the LAPIC count was clamped, keep waiting
+        program(deadline);
+    } else {
+        this_cpu_write(armed, NO_DEADLINE);
+        this_cpu_inc(interrupts);
+        timer_event();
+    }
+    lapic_eoi();
+}
+
+void init_clockevent_cpu() {
+    this_cpu_write(armed, NO_DEADLINE);
+    lapic_write(LAPIC_TIMER_DIVIDE, LAPIC_DIVIDE_16);
+    if (mode == CLOCKEVENT_TSC_DEADLINE) {
+        lapic_write(LAPIC_LVT_TIMER, CLOCKEVENT_VECTOR | LVT_TIMER_TSC_DEADLINE);
+    } else {
+        lapic_write(LAPIC_LVT_TIMER, CLOCKEVENT_VECTOR);
+    }
+}
+
+bool init_clockevent() {
+    if (!apic_enabled()) {
+        return false;
+    }
+
+    lapic_write(LAPIC_TIMER_DIVIDE, LAPIC_DIVIDE_16);
+    lapic_write(LAPIC_LVT_TIMER, LVT_MASKED);
+
+    u64 flags = irq_save();
+    lapic_khz = lapic_window() / CALIBRATION_MS;
+    irq_restore(flags);
+    if (lapic_khz == 0) {
+        return false;
+    }
+
+    u32 eax, ebx, ecx, edx;
+    cpuid(1, 0, &eax, &ebx, &ecx, &edx);
+    mode = (ecx & (1 << 24)) ? CLOCKEVENT_TSC_DEADLINE : CLOCKEVENT_LAPIC_ONESHOT;
+
+    set_interrupt_handler(CLOCKEVENT_VECTOR, clockevent_interrupt_handler);
+    init_clockevent_cpu();
+    return true;
+}
+
+bool clockevent_active() {
+    return mode != CLOCKEVENT_NONE;
+}
+
+void clockevent_arm(u64 deadline_ns) {
+    if (mode == CLOCKEVENT_NONE) {
+        return;
+    }
+
+    u64 deadline = ktime_to_tsc(deadline_ns);
+    u64 flags = irq_save();
+    if (deadline < this_cpu_read(armed)) {
+        this_cpu_write(armed, deadline);
+        program(deadline);
+    }
+    irq_restore(flags);
+}
+
+u64 clockevent_interrupts() {
+    u64 total = 0;
+    for_each_cpu(i) {
+        total += *per_cpu_ptr(interrupts, i);
+    }
+    return total;
+}
@@ -0,0 +1,23 @@
+#pragma once
+
+#include "types.h"
+#include <stdbool.h>
+
+#define CLOCKEVENT_VECTOR 0x30
+
+// Takes over timer interrupts with the TSC-deadline timer, or the LAPIC timer in
+// one-shot mode. Needs the LAPIC and init_time(); returns false without a LAPIC.
+bool init_clockevent();
+
+// Has to run on every CPU
+void init_clockevent_cpu();
+
+bool clockevent_active();
+
+// Requests a timer interrupt once ktime_ns() reaches deadline_ns. Only the
+// earliest pending request is kept, every interrupt drops it, so callers that
+// still wait afterwards have to arm again.
+void clockevent_arm(u64 deadline_ns);
+
+// Timer interrupts taken so far, on all CPUs
+u64 clockevent_interrupts();
@@ -0,0 +1,130 @@
+#pragma once
+
+#include "types.h"
+#include <stdbool.h>
+
+#define MAX_CPUS 64
+#define CACHE_LINE_SIZE 64
+
+#define RFLAGS_IF (1 << 9)
+
+#define KERNEL_STACK_SIZE (16 * 1024)
+
+// Longest stretch with interrupts disabled, see interrupt.c. Build with
+// -DIRQOFF_TRACE=0 to leave it out.
+#ifndef IRQOFF_TRACE
+#define IRQOFF_TRACE 1
+#endif
+
+extern bool irqoff_tracing;
+void irqoff_trace_start();
+void irqoff_trace_stop();
+
+static inline u64 irq_save() {
+    u64 flags;
+    asm volatile("pushfq; popq %0; cli" : "=r"(flags) : : "memory");
+    if (IRQOFF_TRACE && irqoff_tracing && (flags & RFLAGS_IF)) {
+        irqoff_trace_start();
+    }
+    return flags;
+}
+
+static inline void irq_restore(u64 flags) {
+    if (flags & RFLAGS_IF) {
+        if (IRQOFF_TRACE && irqoff_tracing) {
+            irqoff_trace_stop();
+        }
+        asm volatile("sti" : : : "memory");
+    }
+}
+
+#define MSR_PAT 0x277
+#define MSR_EFER 0xC0000080
+#define EFER_NXE (1 << 11)
+
+#define CR0_MP (1 << 1)
+#define CR0_EM (1 << 2)
+#define CR0_TS (1 << 3)
+#define CR0_NE (1 << 5)
+
+#define CR4_PGE (1 << 7)
+#define CR4_OSFXSR (1 << 9)
+#define CR4_OSXMMEXCPT (1 << 10)
+#define CR4_OSXSAVE (1 << 18)
+
+static inline void cpuid(u32 leaf, u32 subleaf, u32* eax, u32* ebx, u32* ecx, u32* edx) {
+    asm volatile("cpuid" : "=a"(*eax), "=b"(*ebx), "=c"(*ecx), "=d"(*edx) : "a"(leaf), "c"(subleaf));
+}
+
+static inline u64 rdmsr(u32 msr) {
+    u32 low, high;
+    asm volatile("rdmsr" : "=a"(low), "=d"(high) : "c"(msr));
+    return ((u64)high << 32) | low;
+}
+
+static inline void wrmsr(u32 msr, u64 value) {
+    asm volatile("wrmsr" : : "c"(msr), "a"((u32)value), "d"((u32)(value >> 32)) : "memory");
+}
+
+static inline u64 read_cr0() {
+    u64 value;
+    asm volatile("mov %%cr0, %0" : "=r"(value));
+    return value;
+}
+
+static inline void write_cr0(u64 value) {
+    asm volatile("mov %0, %%cr0" : : "r"(value) : "memory");
+}
+
+static inline void clts() {
+    asm volatile("clts" : : : "memory");
+}
+
+// The faulting address of the last page fault
+static inline u64 read_cr2() {
+    u64 value;
+    asm volatile("mov %%cr2, %0" : "=r"(value));
+    return value;
+}
+
+static inline u64 read_cr3() {
+    u64 value;
+    asm volatile("mov %%cr3, %0" : "=r"(value));
+    return value;
+}
+
+static inline void write_cr3(u64 value) {
+    asm volatile("mov %0, %%cr3" : : "r"(value) : "memory");
+}
+
+static inline u64 read_cr4() {
+    u64 value;
+    asm volatile("mov %%cr4, %0" : "=r"(value));
+    return value;
+}
+
+static inline void write_cr4(u64 value) {
+    asm volatile("mov %0, %%cr4" : : "r"(value) : "memory");
+}
+
+static inline void xsetbv(u32 xcr, u64 value) {
+    asm volatile("xsetbv" : : "c"(xcr), "a"((u32)value), "d"((u32)(value >> 32)));
+}
+
+static inline void invlpg(u64 virt) {
+    asm volatile("invlpg (%0)" : : "r"(virt) : "memory");
+}
+
+static inline u64 rdtsc() {
+    u32 low, high;
+    asm volatile("rdtsc" : "=a"(low), "=d"(high));
+    return ((u64)high << 32) | low;
+}
+
+static inline void cpu_relax() {
+    asm volatile("pause" : : : "memory");
+}
+
+static inline void wbinvd() {
+    asm volatile("wbinvd" : : : "memory");
+}
@@ -1,6 +1,16 @@
 #include "display.h"
 #include "limine.h"
 #include "utils.h"
+#include "vmm.h"
+#include "cpu.h"
+#include "interrupt.h"
+#include "slab.h"
+#include "font.h"
+#include "fpu.h"
+#include "blit.h"
+#include "time.h"
+#include "timer.h"
+#include "spinlock.h"
 
 __attribute__((used, section(".limine_requests")))
 static volatile struct limine_module_request module_request = {
@@ -15,47 +25,280 @@ static volatile struct limine_framebuffer_request framebuffer_request = {
     .revision = 0
 };
 
-static u64 cursor_x = 0;
-static u64 cursor_y = 0;
 static FrameBuffer FB;
-static PSF1Font FONT;
+static Font FONT;
 
-void put_char(char c, u32 color) {
-    u32* frameBuffer = (u32*)FB.buffer;
-    char* fontBuffer = (char*)FONT.buffer + (c * FONT.header->charSize);
+// The console is a grid of character cells kept as a ring of lines: screen row r
+// shows line (head + r) % rows, so scrolling advances head and blanks one line.
+// display_flush() renders every cell that differs from what is on screen into a
+// RAM back-buffer and copies the changed spans of each text row to the framebuffer,
+// which is never read.
+typedef struct Cell {
+    u32 glyph;
+    u32 color;
+} Cell;
 
-    for (u64 y = cursor_y; y < cursor_y + 16; y++) {
-        for (u64 x = cursor_x; x < cursor_x + 8; x++) {
-            if ((fontBuffer[y-cursor_y] & (0b10000000 >> (x - cursor_x))) > 0) {
-                *(u32*)(frameBuffer + x + (y * FB.width)) = color;
+// never a real glyph, forces a cell to be repainted
+#define INVALID_GLYPH 0xffffffff
+
+static Cell* cells = NULL;
+static Cell* shown;
+static bool* line_dirty;
+static u64 cols;
+static u64 rows;
+static u64 head;
+static u64 cursor_col;
+static u64 cursor_row;
+static u32 blank_glyph;
+static bool scrolled;
+static bool dirty;
+
+static u8* back_buffer;
+static u64 flush_interval_ms = DISPLAY_FLUSH_INTERVAL_MS;
+static u64 last_flush_ms;
+static Timer flush_timer;
+// everything above, the framebuffer included
+static Spinlock console_lock = SPINLOCK_INIT("console");
+
+static inline u64 line_index(u64 screen_row) {
+    u64 line = head + screen_row;
+    return line < rows ? line : line - rows;
+}
+
+static inline Cell* line_cells(u64 screen_row) {
+    return cells + line_index(screen_row) * cols;
+}
+
+// Every possible glyph row byte pre-expanded into 32bpp pixel masks, two pixels
+// per u64, so each byte of a glyph row is drawn with four masked 64-bit stores.
+#define MASKS_PER_BYTE 4
+static u64 row_masks[256][MASKS_PER_BYTE];
+
+static void init_row_masks() {
+    for (u64 bits = 0; bits < 256; bits++) {
+        for (u64 i = 0; i < MASKS_PER_BYTE; i++) {
+            u64 mask = 0;
+            if (bits & (0b10000000 >> (2 * i))) {
+                mask |= 0x00000000ffffffffull;
+            }
+            if (bits & (0b10000000 >> (2 * i + 1))) {
+                mask |= 0xffffffff00000000ull;
             }
+            row_masks[bits][i] = mask;
         }
     }
 }
 
-void print_color(String8 str, u32 color) {
-    for (u64 i = 0; i < str.size; i++) {
-        if (str.str[i] == '\n') {
-            cursor_x = 0;
-            cursor_y += CHAR_HEIGHT;
-        } else {
-            put_char(str.str[i], color);
-            cursor_x += CHAR_WIDTH;
+static inline u8* cell_pixels(u64 row, u64 col) {
+    return back_buffer + row * FONT.height * FB.stride + col * FONT.width * sizeof(u32);
+}
+
+static void draw_cell(u64 row, u64 col, Cell cell) {
+    u8* glyph = font_bitmap(&FONT, cell.glyph);
+    u8* pixels = cell_pixels(row, col);
+    u64 fg = cell.color | (u64)cell.color << 32;
+
+    for (u64 y = 0; y < FONT.height; y++) {
+        u64* out = (u64*)(pixels + y * FB.stride);
+        u64 remaining = FONT.width;
+        for (u64 b = 0; b < FONT.bytes_per_row; b++) {
+            u64* masks = row_masks[glyph[b]];
+            if (remaining >= 8) {
+                out[0] = masks[0] & fg;
+                out[1] = masks[1] & fg;
+                out[2] = masks[2] & fg;
+                out[3] = masks[3] & fg;
+                out += MASKS_PER_BYTE;
+                remaining -= 8;
+            } else {
+                for (u64 i = 0; i < remaining / 2; i++) {
+                    out[i] = masks[i] & fg;
+                }
+                if (remaining & 1) {
+                    ((u32*)out)[remaining - 1] = (u32)(masks[remaining / 2] & fg);
+                }
+            }
+        }
+        glyph += FONT.bytes_per_row;
+    }
+}
+
+// The per-pixel bit test draw_cell used before the masks, only kept for the benchmark
+static void draw_cell_bitwise(u64 row, u64 col, Cell cell) {
+    u8* glyph = font_bitmap(&FONT, cell.glyph);
+    u8* pixels = cell_pixels(row, col);
+
+    for (u64 y = 0; y < FONT.height; y++) {
+        u32* out = (u32*)(pixels + y * FB.stride);
+        for (u64 x = 0; x < FONT.width; x++) {
+            out[x] = (glyph[x / 8] & (0b10000000 >> (x % 8))) ? cell.color : 0;
+        }
+        glyph += FONT.bytes_per_row;
+    }
+}
+
+static void fb_scroll_line() {
+    memmove(FB.buffer, FB.buffer + FONT.height*FB.stride, FB.size - FONT.height*FB.stride - 1);
+    memset(FB.buffer + FB.size - FONT.height*FB.stride, 0, FONT.height*FB.stride - 1);
+}
+
+static void fb_fill(u32 color) {
+    for (u64 y = 0; y < FB.height; y++) {
+        u32* row = (u32*)((u64)FB.buffer + y * FB.stride);
+        for (u64 x = 0; x < FB.width; x++) {
+            row[x] = color;
         }
+    }
+}
+
+static void new_line() {
+    cursor_col = 0;
+    if (cursor_row + 1 < rows) {
+        cursor_row++;
+        return;
+    }
+
+    head = head + 1 < rows ? head + 1 : 0;
+    Cell* line = line_cells(rows - 1);
+    for (u64 col = 0; col < cols; col++) {
+        line[col] = (Cell){blank_glyph, 0};
+    }
+    scrolled = true;
+}
+
+static void put_char(u32 glyph, u32 color) {
+    if (glyph == blank_glyph) {
+        color = 0;
+    }
+    line_cells(cursor_row)[cursor_col] = (Cell){glyph, color};
+    line_dirty[line_index(cursor_row)] = true;
+    dirty = true;
+
+    cursor_col++;
+    if (cursor_col == cols) {
+        new_line();
+    }
+}
+
+static void flush() {
+    if (cells == NULL || !dirty) {
+        return;
+    }
 
-        if (cursor_x + CHAR_WIDTH > FB.width) {
-            cursor_x = 0;
-            cursor_y += CHAR_HEIGHT;
+    bool simd = fpu_available();
+    if (simd) {
+        kernel_fpu_begin();
+    }
+    for (u64 row = 0; row < rows; row++) {
+        u64 line = line_index(row);
+        // after a scroll every screen row may show a different line
+        if (!scrolled && !line_dirty[line]) {
+            continue;
         }
+        line_dirty[line] = false;
+
+        Cell* current = cells + line * cols;
+        Cell* on_screen = shown + row * cols;
+        u64 first = cols;
+        u64 last = 0;
+        for (u64 col = 0; col < cols; col++) {
+            if (current[col].glyph == on_screen[col].glyph && current[col].color == on_screen[col].color) {
+                continue;
+            }
+            draw_cell(row, col, current[col]);
+            on_screen[col] = current[col];
+            if (col < first) {
+                first = col;
+            }
+            last = col + 1;
+        }
+
+        if (first < last) {
+            u64 offset = first * FONT.width * sizeof(u32);
+            u64 size = (last - first) * FONT.width * sizeof(u32);
+            for (u64 y = row * FONT.height; y < (row + 1) * FONT.height; y++) {
+                u8* dest = (u8*)FB.buffer + y * FB.stride + offset;
+                if (simd) {
+                    blit_stream(dest, back_buffer + y * FB.stride + offset, size);
+                } else {
+                    memcpy(dest, back_buffer + y * FB.stride + offset, size);
+                }
+            }
+        }
+    }
+    if (simd) {
+        kernel_fpu_end();
+    }
+
+    scrolled = false;
+    dirty = false;
+    last_flush_ms = uptime_ms();
+}
 
-        if (cursor_y + CHAR_HEIGHT > FB.height) {
-            // scroll
-            memmove(FB.buffer, FB.buffer + CHAR_HEIGHT*FB.stride, FB.size - CHAR_HEIGHT*FB.stride - 1);
-            memset(FB.buffer + FB.size - CHAR_HEIGHT*FB.stride, 0, CHAR_HEIGHT*FB.stride - 1);
-            cursor_y -= CHAR_HEIGHT;
-            cursor_x = 0;
+void display_flush() {
+    u64 flags = spin_lock_irqsave(&console_lock);
+    flush();
+    spin_unlock_irqrestore(&console_lock, flags);
+}
+
+void display_bust_lock() {
+    spin_init(&console_lock, console_lock.dep.name);
+}
+
+void display_set_flush_interval(u64 millis) {
+    flush_interval_ms = millis;
+}
+
+// Flushes now if the interval has passed, otherwise makes sure the flush timer is pending
+static void schedule_flush() {
+    if (!dirty) {
+        return;
+    }
+    if (uptime_ms() - last_flush_ms >= flush_interval_ms) {
+        flush();
+    } else if (!timer_pending(&flush_timer)) {
+        timer_add(&flush_timer, (last_flush_ms + flush_interval_ms) * NS_PER_MS);
+    }
+}
+
+static void flush_timer_expired(void* data) {
+    (void)data;
+    u64 flags = spin_lock_irqsave(&console_lock);
+    schedule_flush();
+    spin_unlock_irqrestore(&console_lock, flags);
+}
+
+// Everything on screen has to be repainted on the next flush
+static void invalidate_screen() {
+    for (u64 i = 0; i < rows * cols; i++) {
+        shown[i].glyph = INVALID_GLYPH;
+    }
+    scrolled = true;
+    dirty = true;
+}
+
+void print_color(String8 str, u32 color) {
+    if (cells == NULL) {
+        return;
+    }
+
+    u64 flags = spin_lock_irqsave(&console_lock);
+    u64 i = 0;
+    while (i < str.size) {
+        u32 codepoint = str8_decode_utf8(str, &i);
+        if (codepoint == '\n') {
+            new_line();
+        } else {
+            put_char(font_glyph(&FONT, codepoint), color);
         }
     }
+
+    if (flush_interval_ms == 0) {
+        flush();
+    } else {
+        schedule_flush();
+    }
+    spin_unlock_irqrestore(&console_lock, flags);
 }
 
 void print(String8 str) {
@@ -66,6 +309,11 @@ void print_err(String8 str) {
     print_color(str, RED);
 }
 
+void print_u64(u64 x) {
+    u8 buffer[32];
+    print(u64_to_str8(x, buffer, 32));
+}
+
 static struct limine_file* limine_get_file(String8 name) {
     struct limine_module_response* response = module_request.response;
 
@@ -103,9 +351,124 @@ void init_display() {
         hcf();
     }
 
-    FONT.header = file->address;
-    if (FONT.header->magic[0] != 0x36 || FONT.header->magic[1] != 0x04) {
+    if (!font_load(&FONT, file->address, file->size)) {
+        hcf();
+    }
+    init_row_masks();
+    blank_glyph = font_glyph(&FONT, ' ');
+
+    cols = FB.width / FONT.width;
+    rows = FB.height / FONT.height;
+    Cell* grid = kmalloc(rows * cols * sizeof(Cell));
+    shown = kmalloc(rows * cols * sizeof(Cell));
+    line_dirty = kmalloc(rows * sizeof(bool));
+    back_buffer = vmm_alloc(rows * FONT.height * FB.stride);
+    if (grid == NULL || shown == NULL || line_dirty == NULL || back_buffer == NULL) {
         hcf();
     }
-    FONT.buffer = (void*)((u64)file->address + sizeof(PSF1Header));
+
+    for (u64 i = 0; i < rows * cols; i++) {
+        grid[i] = (Cell){blank_glyph, 0};
+    }
+    for (u64 i = 0; i < rows; i++) {
+        line_dirty[i] = false;
+    }
+    head = 0;
+    cursor_col = 0;
+    cursor_row = 0;
+    timer_init(&flush_timer, flush_timer_expired, NULL);
+    cells = grid;
+    invalidate_screen();
+}
+
+void display_map_write_combining() {
+    if (!vmm_set_caching((u64)FB.buffer, FB.size, PTE_CACHE_WC)) {
+        print_err(str8_lit("display: framebuffer is not mapped\n"));
+    }
+}
+
+#define BENCH_FILLS 4
+#define BENCH_SCROLLS 16
+
+static void benchmark_framebuffer(u64* fill_cycles, u64* scroll_cycles) {
+    u64 start = cycles_begin();
+    for (u64 i = 0; i < BENCH_FILLS; i++) {
+        fb_fill(i & 1 ? 0x202020 : 0);
+    }
+    *fill_cycles = (cycles_end() - start) / BENCH_FILLS;
+
+    start = cycles_begin();
+    for (u64 i = 0; i < BENCH_SCROLLS; i++) {
+        fb_scroll_line();
+    }
+    *scroll_cycles = (cycles_end() - start) / BENCH_SCROLLS;
+}
+
+static void print_speedup(u64 before, u64 after) {
+    u64 tenths = before * 10 / (after ? after : 1);
+    print_u64(tenths / 10);
+    print(str8_lit("."));
+    print_u64(tenths % 10);
+    print(str8_lit("x"));
+}
+
+void display_benchmark_write_combining() {
+    u64 uc_fill, uc_scroll, wc_fill, wc_scroll;
+
+    vmm_set_caching((u64)FB.buffer, FB.size, PTE_CACHE_UC);
+    benchmark_framebuffer(&uc_fill, &uc_scroll);
+    display_map_write_combining();
+    benchmark_framebuffer(&wc_fill, &wc_scroll);
+
+    // the benchmark wiped whatever was on screen
+    fb_fill(0);
+    invalidate_screen();
+
+    print(str8_lit("display: fill uc="));
+    print_u64(uc_fill);
+    print(str8_lit(" wc="));
+    print_u64(wc_fill);
+    print(str8_lit(" cycles ("));
+    print_speedup(uc_fill, wc_fill);
+    print(str8_lit("), scroll uc="));
+    print_u64(uc_scroll);
+    print(str8_lit(" wc="));
+    print_u64(wc_scroll);
+    print(str8_lit(" cycles ("));
+    print_speedup(uc_scroll, wc_scroll);
+    print(str8_lit(")\n"));
+}
+
+#define BENCH_GLYPHS 200000
+
+static void benchmark_glyphs(void (*draw)(u64 row, u64 col, Cell cell), u64* per_second, u64* cycles) {
+    u64 start = cycles_begin();
+    for (u64 i = 0; i < BENCH_GLYPHS; i++) {
+        u64 cell = i % (rows * cols);
+        draw(cell / cols, cell % cols, (Cell){i % FONT.glyph_count, WHITE});
+    }
+    u64 elapsed = cycles_end() - start;
+    *cycles = elapsed / BENCH_GLYPHS;
+    u64 elapsed_ns = cycles_to_ns(elapsed);
+    *per_second = BENCH_GLYPHS * NS_PER_SEC / (elapsed_ns ? elapsed_ns : 1);
+}
+
+void display_benchmark_glyphs() {
+    u64 bitwise_rate, bitwise_cycles, masked_rate, masked_cycles;
+    benchmark_glyphs(draw_cell_bitwise, &bitwise_rate, &bitwise_cycles);
+    benchmark_glyphs(draw_cell, &masked_rate, &masked_cycles);
+    // both runs scribbled over the back-buffer
+    invalidate_screen();
+
+    print(str8_lit("display: glyphs/s bitwise="));
+    print_u64(bitwise_rate);
+    print(str8_lit(" ("));
+    print_u64(bitwise_cycles);
+    print(str8_lit(" cycles) masked="));
+    print_u64(masked_rate);
+    print(str8_lit(" ("));
+    print_u64(masked_cycles);
+    print(str8_lit(" cycles), "));
+    print_speedup(bitwise_cycles, masked_cycles);
+    print(str8_lit("\n"));
 }
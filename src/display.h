@@ -2,17 +2,15 @@
 
 #include "string.h"
 
-void put_char(char c, u32 color);
-
-#define CHAR_HEIGHT 16
-#define CHAR_WIDTH 8
-
+// str is UTF-8, code points without a glyph in the font render as a fallback glyph
 void print_color(String8 str, u32 color);
 
 void print(String8 str);
 
 void print_err(String8 str);
 
+void print_u64(u64 x);
+
 typedef struct FrameBuffer {
     void* buffer;
     u64 size;
@@ -21,18 +19,29 @@ typedef struct FrameBuffer {
     u64 stride;
 } FrameBuffer;
 
-typedef struct PSF1Header {
-    u8 magic[2];
-    u8 mode;
-    u8 charSize;
-} PSF1Header;
-
-typedef struct PSF1Font {
-    PSF1Header* header;
-    void* buffer;
-} PSF1Font;
-
 #define WHITE 0xffffff
 #define RED 0xff0000
 
+// Needs the VMM and kmalloc for the console grid and back-buffer
 void init_display();
+
+// Remaps the framebuffer as write-combining
+void display_map_write_combining();
+
+// Times framebuffer fills and scrolls uncached and write-combining, leaves it write-combining
+void display_benchmark_write_combining();
+
+// Glyph rendering throughput of the bit test and pre-expanded mask paths, needs init_time()
+void display_benchmark_glyphs();
+
+// Console contents reach the screen on every print when the interval is 0,
+// otherwise at most every interval milliseconds (driven by a timer) or on display_flush
+#define DISPLAY_FLUSH_INTERVAL_MS 16
+
+void display_set_flush_interval(u64 millis);
+
+void display_flush();
+
+// Forces the console lock open, so a CPU that stops the kernel can still print
+void display_bust_lock();
+
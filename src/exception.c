@@ -0,0 +1,186 @@
+#include "exception.h"
+#include "gdt.h"
+#include "cpu.h"
+#include "percpu.h"
+#include "display.h"
+#include "string.h"
+#include "utils.h"
+
+#define EXCEPTION_VECTORS 32
+#define MAX_PAGE_FAULT_RANGES 8
+
+typedef struct PageFaultRange {
+    u64 start;
+    u64 end;
+    PageFaultHandler handler;
+} PageFaultRange;
+
+static PageFaultRange ranges[MAX_PAGE_FAULT_RANGES];
+static u32 range_count;
+
+PERCPU static u64 page_faults;
+PERCPU static u64 nmis;
+
+static String8 names[EXCEPTION_VECTORS] = {
+    STR8_INIT("divide error"), STR8_INIT("debug"),
+    STR8_INIT("nmi"), STR8_INIT("breakpoint"),
+    STR8_INIT("overflow"), STR8_INIT("bound range exceeded"),
+    STR8_INIT("invalid opcode"), STR8_INIT("device not available"),
+    STR8_INIT("double fault"), STR8_INIT("coprocessor segment overrun"),
+    STR8_INIT("invalid tss"), STR8_INIT("segment not present"),
+    STR8_INIT("stack fault"), STR8_INIT("general protection"),
+    STR8_INIT("page fault"), STR8_INIT("reserved"),
+    STR8_INIT("x87 floating point"), STR8_INIT("alignment check"),
+    STR8_INIT("machine check"), STR8_INIT("simd floating point"),
+    STR8_INIT("virtualization"), STR8_INIT("control protection"),
+    STR8_INIT("reserved"), STR8_INIT("reserved"),
+    STR8_INIT("reserved"), STR8_INIT("reserved"),
+    STR8_INIT("reserved"), STR8_INIT("reserved"),
+    STR8_INIT("hypervisor injection"), STR8_INIT("vmm communication"),
+    STR8_INIT("security"), STR8_INIT("reserved"),
+};
+
+static void print_hex(String8 label, u64 value) {
+    u8 buffer[64];
+    print_err(label);
+    print_err(u64_to_str8_hex(value, buffer, 64));
+}
+
+// Error codes that name a segment selector: #TS, #NP, #SS and #GP
+static void print_selector_error(u64 error) {
+    if (error == 0) {
+        return;
+    }
+    print_hex(str8_lit("\n  selector index "), (error >> 3) & 0x1fff);
+    if (error & 2) {
+        print_err(str8_lit(" in the IDT"));
+    } else {
+        print_err((error & 4) ? str8_lit(" in the LDT") : str8_lit(" in the GDT"));
+    }
+    if (error & 1) {
+        print_err(str8_lit(", external event"));
+    }
+}
+
+static void print_page_fault(u64 address, u64 error) {
+    print_hex(str8_lit("\n  "), address);
+    print_err((error & PF_USER) ? str8_lit(": user ") : str8_lit(": kernel "));
+    if (error & PF_FETCH) {
+        print_err(str8_lit("instruction fetch"));
+    } else {
+        print_err((error & PF_WRITE) ? str8_lit("write") : str8_lit("read"));
+    }
+    print_err((error & PF_PRESENT) ? str8_lit(", protection violation") : str8_lit(", page not present"));
+    if (error & PF_RESERVED) {
+        print_err(str8_lit(", reserved bit set"));
+    }
+}
+
+// address is the CR2 page_fault_handler() saved, a nested fault may have changed it since
+static void fatal(TrapFrame* frame, u64 address) {
+    // the fault may have hit with the console lock held
+    display_bust_lock();
+    print_err(str8_lit("exception: "));
+    print_err(names[frame->vector]);
+    print_err(str8_lit(" on cpu "));
+    print_u64(current_cpu());
+    print_hex(str8_lit(", error "), frame->error_code);
+
+    switch (frame->vector) {
+    case VECTOR_INVALID_TSS:
+    case VECTOR_SEGMENT_NOT_PRESENT:
+    case VECTOR_STACK_FAULT:
+    case VECTOR_GENERAL_PROTECTION:
+        print_selector_error(frame->error_code);
+        break;
+    case VECTOR_PAGE_FAULT:
+        print_page_fault(address, frame->error_code);
+        break;
+    }
+
+    print_hex(str8_lit("\n  rip "), frame->rip);
+    print_hex(str8_lit(" cs "), frame->cs);
+    print_hex(str8_lit(" rflags "), frame->rflags);
+    print_hex(str8_lit(" rsp "), frame->rsp);
+    print_hex(str8_lit("\n  rax "), frame->rax);
+    print_hex(str8_lit(" rbx "), frame->rbx);
+    print_hex(str8_lit(" rcx "), frame->rcx);
+    print_hex(str8_lit(" rdx "), frame->rdx);
+    print_hex(str8_lit("\n  rsi "), frame->rsi);
+    print_hex(str8_lit(" rdi "), frame->rdi);
+    print_hex(str8_lit(" rbp "), frame->rbp);
+    print_hex(str8_lit("\n  r8 "), frame->r8);
+    print_hex(str8_lit(" r9 "), frame->r9);
+    print_hex(str8_lit(" r10 "), frame->r10);
+    print_hex(str8_lit(" r11 "), frame->r11);
+    print_hex(str8_lit("\n  r12 "), frame->r12);
+    print_hex(str8_lit(" r13 "), frame->r13);
+    print_hex(str8_lit(" r14 "), frame->r14);
+    print_hex(str8_lit(" r15 "), frame->r15);
+    print_hex(str8_lit("\n  cr3 "), read_cr3());
+    print_err(str8_lit("\n"));
+    display_flush();
+    // interrupts stay disabled, this CPU is done
+    hcf();
+}
+
+static void exception_handler(TrapFrame* frame) {
+    fatal(frame, 0);
+}
+
+// Kept short: it runs before anything else could take the fault, and on the way
+// to demand paged memory it is the whole cost of a fault
+static void page_fault_handler(TrapFrame* frame) {
+    u64 address = read_cr2();
+    this_cpu_inc(page_faults);
+    for (u32 i = 0; i < range_count; i++) {
+        if (address >= ranges[i].start && address < ranges[i].end) {
+            if (ranges[i].handler(address, frame->error_code)) {
+                return;
+            }
+            break;
+        }
+    }
+    fatal(frame, address);
+}
+
+// Without a watchdog or profiler NMIs have nothing to do. Printing here could
+// deadlock on whatever the interrupted code held, they are only counted.
+static void nmi_handler(TrapFrame* frame) {
+    (void)frame;
+    this_cpu_inc(nmis);
+}
+
+bool page_fault_register(u64 start, u64 end, PageFaultHandler handler) {
+    if (range_count == MAX_PAGE_FAULT_RANGES) {
+        return false;
+    }
+    ranges[range_count++] = (PageFaultRange){start, end, handler};
+    return true;
+}
+
+void init_exceptions() {
+    for (u32 vector = 0; vector < EXCEPTION_VECTORS; vector++) {
+        set_interrupt_handler(vector, exception_handler);
+    }
+    set_interrupt_handler(VECTOR_NMI, nmi_handler);
+    set_interrupt_handler(VECTOR_PAGE_FAULT, page_fault_handler);
+
+    set_interrupt_ist(VECTOR_DOUBLE_FAULT, IST_DOUBLE_FAULT);
+    set_interrupt_ist(VECTOR_NMI, IST_NMI);
+    set_interrupt_ist(VECTOR_MACHINE_CHECK, IST_MACHINE_CHECK);
+}
+
+void exception_print_stats() {
+    u64 total_page_faults = 0;
+    u64 total_nmis = 0;
+    for_each_cpu(i) {
+        total_page_faults += *per_cpu_ptr(page_faults, i);
+        total_nmis += *per_cpu_ptr(nmis, i);
+    }
+    print(str8_lit("exception: page faults="));
+    print_u64(total_page_faults);
+    print(str8_lit(" nmis="));
+    print_u64(total_nmis);
+    print(str8_lit("\n"));
+}
@@ -0,0 +1,35 @@
+#pragma once
+
+#include "types.h"
+#include "interrupt.h"
+#include <stdbool.h>
+
+#define VECTOR_NMI 2
+#define VECTOR_DOUBLE_FAULT 8
+#define VECTOR_INVALID_TSS 10
+#define VECTOR_SEGMENT_NOT_PRESENT 11
+#define VECTOR_STACK_FAULT 12
+#define VECTOR_GENERAL_PROTECTION 13
+#define VECTOR_PAGE_FAULT 14
+#define VECTOR_MACHINE_CHECK 18
+
+// Page fault error code bits
+#define PF_PRESENT (1 << 0)  // a protection violation rather than a missing page
+#define PF_WRITE (1 << 1)
+#define PF_USER (1 << 2)
+#define PF_RESERVED (1 << 3) // a reserved bit set in a paging structure
+#define PF_FETCH (1 << 4)
+
+// Gets the faulting address and the error code with interrupts disabled. Returns
+// true once the access can be retried, false has the fault reported as fatal.
+typedef bool (*PageFaultHandler)(u64 address, u64 error_code);
+
+// Routes page faults in [start, end) to handler. Ranges are registered during
+// init and can't overlap, false once the table is full.
+bool page_fault_register(u64 start, u64 end, PageFaultHandler handler);
+
+// Installs a handler for each exception, with #DF, NMI and #MC on their IST stacks.
+// Runs in init_interrupts().
+void init_exceptions();
+
+void exception_print_stats();
@@ -0,0 +1,162 @@
+#include "font.h"
+#include "string.h"
+#include "slab.h"
+#include "utils.h"
+
+#define UNICODE_PAGES (UNICODE_MAX >> UNICODE_PAGE_SHIFT)
+#define UNMAPPED 0xFFFF
+#define REPLACEMENT_CHARACTER 0xFFFD
+
+typedef void (*UnicodeEmit)(Font* font, u32 codepoint, u32 glyph);
+
+static u32 page_count;
+
+static void reserve_page(Font* font, u32 codepoint, u32 glyph) {
+    (void)glyph;
+    if (codepoint >= UNICODE_MAX) {
+        return;
+    }
+    u16* page = &font->unicode_directory[codepoint >> UNICODE_PAGE_SHIFT];
+    if (*page == 0) {
+        *page = ++page_count;
+    }
+}
+
+static void set_glyph(Font* font, u32 codepoint, u32 glyph) {
+    if (codepoint >= UNICODE_MAX) {
+        return;
+    }
+    u32 page = font->unicode_directory[codepoint >> UNICODE_PAGE_SHIFT];
+    font->unicode_pages[page * UNICODE_PAGE_SIZE + (codepoint & (UNICODE_PAGE_SIZE - 1))] = glyph;
+}
+
+// PSF1 tables are little endian u16 code points, PSF2 tables are UTF-8. In both,
+// every glyph's entry ends with a separator and multi code point sequences
+// (which we don't render) follow a start-of-sequence marker.
+static void walk_unicode_table(Font* font, u8* table, u8* end, bool psf2, UnicodeEmit emit) {
+    if (table == NULL) {
+        for (u32 glyph = 0; glyph < font->glyph_count; glyph++) {
+            emit(font, glyph, glyph);
+        }
+        return;
+    }
+
+    if (!psf2) {
+        u16* entry = (u16*)table;
+        for (u32 glyph = 0; glyph < font->glyph_count && (u8*)(entry + 1) <= end; glyph++) {
+            bool sequence = false;
+            while ((u8*)(entry + 1) <= end) {
+                u16 value = *entry++;
+                if (value == PSF1_SEPARATOR) {
+                    break;
+                }
+                if (value == PSF1_STARTSEQ) {
+                    sequence = true;
+                } else if (!sequence) {
+                    emit(font, value, glyph);
+                }
+            }
+        }
+        return;
+    }
+
+    String8 entries = str8(table, end - table);
+    u64 i = 0;
+    for (u32 glyph = 0; glyph < font->glyph_count && i < entries.size; glyph++) {
+        bool sequence = false;
+        while (i < entries.size) {
+            if (entries.str[i] == PSF2_SEPARATOR) {
+                i++;
+                break;
+            }
+            if (entries.str[i] == PSF2_STARTSEQ) {
+                sequence = true;
+                i++;
+                continue;
+            }
+            u32 codepoint = str8_decode_utf8(entries, &i);
+            if (!sequence) {
+                emit(font, codepoint, glyph);
+            }
+        }
+    }
+}
+
+bool font_load(Font* font, void* data, u64 size) {
+    u8* end = (u8*)data + size;
+    u8* table = NULL;
+    bool psf2 = false;
+
+    PSF1Header* psf1_header = data;
+    PSF2Header* psf2_header = data;
+    if (size >= sizeof(PSF1Header)
+     && psf1_header->magic[0] == PSF1_MAGIC0 && psf1_header->magic[1] == PSF1_MAGIC1) {
+        font->width = 8;
+        font->height = psf1_header->charSize;
+        font->bytes_per_row = 1;
+        font->bytes_per_glyph = psf1_header->charSize;
+        font->glyph_count = (psf1_header->mode & PSF1_MODE512) ? 512 : 256;
+        font->glyphs = (u8*)data + sizeof(PSF1Header);
+        if (psf1_header->mode & (PSF1_MODEHASTAB | PSF1_MODESEQ)) {
+            table = font->glyphs + font->glyph_count * font->bytes_per_glyph;
+        }
+    } else if (size >= sizeof(PSF2Header) && psf2_header->magic == PSF2_MAGIC) {
+        font->width = psf2_header->width;
+        font->height = psf2_header->height;
+        font->bytes_per_row = (psf2_header->width + 7) / 8;
+        font->bytes_per_glyph = psf2_header->bytesPerGlyph;
+        font->glyph_count = psf2_header->glyphCount;
+        font->glyphs = (u8*)data + psf2_header->headerSize;
+        if (psf2_header->flags & PSF2_HAS_UNICODE_TABLE) {
+            table = font->glyphs + (u64)font->glyph_count * font->bytes_per_glyph;
+            psf2 = true;
+        }
+    } else {
+        return false;
+    }
+
+    if (font->width == 0 || font->height == 0 || font->glyph_count == 0
+     || font->bytes_per_glyph < font->bytes_per_row * font->height
+     || font->glyphs + (u64)font->glyph_count * font->bytes_per_glyph > end) {
+        return false;
+    }
+    // glyph indices are stored as u16, with UNMAPPED reserved
+    if (font->glyph_count >= UNMAPPED) {
+        font->glyph_count = UNMAPPED - 1;
+    }
+
+    font->unicode_directory = kmalloc(UNICODE_PAGES * sizeof(u16));
+    if (font->unicode_directory == NULL) {
+        return false;
+    }
+    memset(font->unicode_directory, 0, UNICODE_PAGES * sizeof(u16));
+
+    page_count = 0;
+    walk_unicode_table(font, table, end, psf2, reserve_page);
+
+    u64 entries = (u64)(page_count + 1) * UNICODE_PAGE_SIZE;
+    font->unicode_pages = kmalloc(entries * sizeof(u16));
+    if (font->unicode_pages == NULL) {
+        kfree(font->unicode_directory);
+        return false;
+    }
+    for (u64 i = 0; i < entries; i++) {
+        font->unicode_pages[i] = UNMAPPED;
+    }
+    walk_unicode_table(font, table, end, psf2, set_glyph);
+
+    // unmapped code points render as the replacement character, or '?', or glyph 0
+    font->fallback_glyph = font_glyph(font, REPLACEMENT_CHARACTER);
+    if (font->fallback_glyph == UNMAPPED) {
+        font->fallback_glyph = font_glyph(font, '?');
+    }
+    if (font->fallback_glyph == UNMAPPED) {
+        font->fallback_glyph = 0;
+    }
+    for (u64 i = 0; i < entries; i++) {
+        if (font->unicode_pages[i] == UNMAPPED) {
+            font->unicode_pages[i] = font->fallback_glyph;
+        }
+    }
+    return true;
+}
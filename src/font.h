@@ -0,0 +1,69 @@
+#pragma once
+
+#include "types.h"
+#include <stdbool.h>
+
+typedef struct PSF1Header {
+    u8 magic[2];
+    u8 mode;
+    u8 charSize;
+} PSF1Header;
+
+#define PSF1_MAGIC0 0x36
+#define PSF1_MAGIC1 0x04
+#define PSF1_MODE512 0x01
+#define PSF1_MODEHASTAB 0x02
+#define PSF1_MODESEQ 0x04
+#define PSF1_SEPARATOR 0xFFFF
+#define PSF1_STARTSEQ 0xFFFE
+
+typedef struct PSF2Header {
+    u32 magic;
+    u32 version;
+    u32 headerSize;
+    u32 flags;
+    u32 glyphCount;
+    u32 bytesPerGlyph;
+    u32 height;
+    u32 width;
+} PSF2Header;
+
+#define PSF2_MAGIC 0x864ab572
+#define PSF2_HAS_UNICODE_TABLE 0x01
+#define PSF2_SEPARATOR 0xFF
+#define PSF2_STARTSEQ 0xFE
+
+#define UNICODE_MAX 0x110000
+#define UNICODE_PAGE_SHIFT 8
+#define UNICODE_PAGE_SIZE (1 << UNICODE_PAGE_SHIFT)
+
+// Code points map to glyphs through a two level table built at load time:
+// unicode_directory holds a page number for every 256 code points and page 0
+// maps everything to the fallback glyph, so a lookup is two loads.
+typedef struct Font {
+    u32 width;
+    u32 height;
+    u32 bytes_per_row;
+    u32 bytes_per_glyph;
+    u32 glyph_count;
+    u8* glyphs;
+
+    u16* unicode_directory;
+    u16* unicode_pages;
+    u32 fallback_glyph;
+} Font;
+
+// Accepts PSF1 and PSF2 fonts, with or without a unicode table
+bool font_load(Font* font, void* data, u64 size);
+
+static inline u32 font_glyph(Font* font, u32 codepoint) {
+    if (codepoint >= UNICODE_MAX) {
+        return font->fallback_glyph;
+    }
+    u32 page = font->unicode_directory[codepoint >> UNICODE_PAGE_SHIFT];
+    return font->unicode_pages[page * UNICODE_PAGE_SIZE + (codepoint & (UNICODE_PAGE_SIZE - 1))];
+}
+
+static inline u8* font_bitmap(Font* font, u32 glyph) {
+    return font->glyphs + glyph * font->bytes_per_glyph;
+}
@@ -0,0 +1,226 @@
+#include "fpu.h"
+#include "cpu.h"
+#include "percpu.h"
+#include "slab.h"
+#include "utils.h"
+#include "display.h"
+#include "interrupt.h"
+
+#define NM_VECTOR 7 // device not available, raised by FPU/SSE instructions while CR0.TS is set
+
+#define XCR0_X87 (1 << 0)
+#define XCR0_SSE (1 << 1)
+#define XCR0_AVX (1 << 2)
+
+#define FXSAVE_SIZE 512
+#define MXCSR_DEFAULT 0x1f80 // all exceptions masked
+
+typedef struct FpuCpu {
+    FpuState* current; // state of whatever runs on this CPU
+    FpuState* owner;   // state currently loaded in the registers, NULL if they hold nothing worth saving
+    u64 irq_flags;     // of the open kernel_fpu section
+    u64 lazy_restores;
+    u64 saves;
+    u64 kernel_sections;
+} __attribute__((aligned(CACHE_LINE_SIZE))) FpuCpu;
+
+PERCPU static FpuCpu fpu_cpu;
+
+static bool enabled;
+static bool has_xsave;
+static u64 xcr0;
+static u64 state_size = FXSAVE_SIZE;
+static KmemCache* state_cache;
+// registers right after fninit, copied into every new state
+static FpuState* init_state;
+
+static inline void stts() {
+    write_cr0(read_cr0() | CR0_TS);
+}
+
+static void save(FpuState* state) {
+    if (has_xsave) {
+        asm volatile("xsave64 (%0)" : : "r"(state), "a"((u32)xcr0), "d"((u32)(xcr0 >> 32)) : "memory");
+    } else {
+        asm volatile("fxsave64 (%0)" : : "r"(state) : "memory");
+    }
+}
+
+static void restore(FpuState* state) {
+    if (has_xsave) {
+        asm volatile("xrstor64 (%0)" : : "r"(state), "a"((u32)xcr0), "d"((u32)(xcr0 >> 32)) : "memory");
+    } else {
+        asm volatile("fxrstor64 (%0)" : : "r"(state) : "memory");
+    }
+}
+
+static void device_not_available_handler(TrapFrame* frame) {
+    (void)frame;
+    FpuCpu* cpu = this_cpu_ptr(fpu_cpu);
+    clts();
+    if (cpu->owner == cpu->current) {
+        return;
+    }
+    if (cpu->current == NULL) {
+        print_err(str8_lit("fpu: vector registers used outside of a kernel_fpu section\n"));
+        hcf();
+    }
+
+    if (cpu->owner != NULL) {
+        save(cpu->owner);
+        cpu->saves++;
+    }
+    restore(cpu->current);
+    cpu->owner = cpu->current;
+    cpu->lazy_restores++;
+}
+
+void init_fpu_cpu() {
+    write_cr0((read_cr0() & ~(u64)CR0_EM) | CR0_MP | CR0_NE);
+    u64 cr4 = read_cr4() | CR4_OSFXSR | CR4_OSXMMEXCPT;
+    if (has_xsave) {
+        cr4 |= CR4_OSXSAVE;
+    }
+    write_cr4(cr4);
+    if (has_xsave) {
+        xsetbv(0, xcr0);
+    }
+
+    u32 mxcsr = MXCSR_DEFAULT;
+    asm volatile("fninit; ldmxcsr %0" : : "m"(mxcsr));
+    // the first FPU instruction traps and loads the running thread's state
+    stts();
+}
+
+void init_fpu() {
+    u32 eax, ebx, ecx, edx;
+    cpuid(1, 0, &eax, &ebx, &ecx, &edx);
+    // always there in long mode, but the state format depends on them
+    if ((edx & (1 << 24)) == 0 || (edx & (1 << 26)) == 0) {
+        print_err(str8_lit("fpu: FXSR/SSE2 missing\n"));
+        return;
+    }
+    has_xsave = (ecx & (1 << 26)) != 0;
+    if (has_xsave) {
+        xcr0 = XCR0_X87 | XCR0_SSE;
+        if (ecx & (1 << 28)) {
+            xcr0 |= XCR0_AVX;
+        }
+    }
+
+    init_fpu_cpu();
+    if (has_xsave) {
+        // EBX is the size needed for the features currently enabled in XCR0
+        cpuid(0xd, 0, &eax, &ebx, &ecx, &edx);
+        state_size = ebx;
+    }
+
+    // XSAVE needs 64 byte alignment
+    state_cache = kmem_cache_create(str8_lit("fpu-state"), state_size, 64, NULL);
+    init_state = state_cache != NULL ? kmem_cache_alloc(state_cache) : NULL;
+    if (init_state == NULL) {
+        print_err(str8_lit("fpu: can't allocate save areas\n"));
+        hcf();
+    }
+    // XRSTOR faults on a non-zero reserved header, XSAVE only writes what it needs
+    memset(init_state, 0, state_size);
+    clts();
+    save(init_state);
+    stts();
+
+    set_interrupt_handler(NM_VECTOR, device_not_available_handler);
+    enabled = true;
+    // kmain's own context
+    this_cpu_ptr(fpu_cpu)->current = fpu_state_create();
+}
+
+bool fpu_available() {
+    return enabled;
+}
+
+u64 fpu_state_size() {
+    return state_size;
+}
+
+FpuState* fpu_state_create() {
+    FpuState* state = kmem_cache_alloc(state_cache);
+    if (state != NULL) {
+        memcpy(state, init_state, state_size);
+    }
+    return state;
+}
+
+void fpu_state_destroy(FpuState* state) {
+    u64 flags = irq_save();
+    FpuCpu* cpu = this_cpu_ptr(fpu_cpu);
+    if (cpu->owner == state) {
+        cpu->owner = NULL;
+    }
+    if (cpu->current == state) {
+        cpu->current = NULL;
+    }
+    irq_restore(flags);
+    kmem_cache_free(state_cache, state);
+}
+
+void fpu_switch(FpuState* next) {
+    FpuCpu* cpu = this_cpu_ptr(fpu_cpu);
+    cpu->current = next;
+    // switching back to the owner needs no trap, its registers were never touched.
+    // CR0 writes serialize, most switches find TS the way they need it already.
+    u64 cr0 = read_cr0();
+    u64 wanted = cpu->owner == next ? cr0 & ~CR0_TS : cr0 | CR0_TS;
+    if (wanted != cr0) {
+        write_cr0(wanted);
+    }
+}
+
+FpuState* fpu_current() {
+    return this_cpu_ptr(fpu_cpu)->current;
+}
+
+void kernel_fpu_begin() {
+    u64 flags = irq_save();
+    FpuCpu* cpu = this_cpu_ptr(fpu_cpu);
+    clts();
+    if (cpu->owner != NULL) {
+        save(cpu->owner);
+        cpu->owner = NULL;
+        cpu->saves++;
+    }
+    cpu->irq_flags = flags;
+    cpu->kernel_sections++;
+}
+
+void kernel_fpu_end() {
+    FpuCpu* cpu = this_cpu_ptr(fpu_cpu);
+    // the registers now hold kernel scratch values, the next user traps and reloads its own
+    stts();
+    irq_restore(cpu->irq_flags);
+}
+
+void fpu_print_stats() {
+    u64 lazy_restores = 0;
+    u64 saves = 0;
+    u64 kernel_sections = 0;
+    for_each_cpu(i) {
+        FpuCpu* cpu = per_cpu_ptr(fpu_cpu, i);
+        lazy_restores += cpu->lazy_restores;
+        saves += cpu->saves;
+        kernel_sections += cpu->kernel_sections;
+    }
+
+    print(has_xsave ? str8_lit("fpu: xsave") : str8_lit("fpu: fxsave"));
+    if (xcr0 & XCR0_AVX) {
+        print(str8_lit(" avx"));
+    }
+    print(str8_lit(", state="));
+    print_u64(state_size);
+    print(str8_lit(" bytes, kernel sections="));
+    print_u64(kernel_sections);
+    print(str8_lit(" lazy restores="));
+    print_u64(lazy_restores);
+    print(str8_lit(" saves="));
+    print_u64(saves);
+    print(str8_lit("\n"));
+}
@@ -0,0 +1,40 @@
+#pragma once
+
+#include "types.h"
+#include <stdbool.h>
+
+// Saved x87/SSE/AVX registers of one thread, in FXSAVE or XSAVE format
+typedef struct FpuState FpuState;
+
+// Enables SSE (and AVX where XSAVE allows it) and installs the #NM handler.
+// Needs kmalloc and the IDT.
+void init_fpu();
+
+// Has to run on every CPU, the control registers and XCR0 are per logical processor
+void init_fpu_cpu();
+
+bool fpu_available();
+
+// Size of an FpuState, as reported by CPUID for the enabled features
+u64 fpu_state_size();
+
+FpuState* fpu_state_create();
+
+void fpu_state_destroy(FpuState* state);
+
+// Called on a context switch. The registers are restored lazily: next's state
+// is only loaded once it executes an FPU/SSE instruction, so threads that never
+// touch vector registers never pay for saving or restoring them.
+void fpu_switch(FpuState* next);
+
+// State of whatever runs on this CPU right now
+FpuState* fpu_current();
+
+// Kernel code may only use vector registers between these. Sections can't nest and
+// run with interrupts disabled. The code inside belongs in a *.simd.c translation
+// unit, everything else is built without SSE.
+void kernel_fpu_begin();
+
+void kernel_fpu_end();
+
+void fpu_print_stats();
@@ -1,4 +1,9 @@
 #include "gdt.h"
+#include "slab.h"
+#include "vmm.h"
+#include "utils.h"
+#include "cpu.h"
+#include "percpu.h"
 
 u64 create_gdt_descriptor(uint32_t base, uint32_t limit, uint16_t flag)
 {
@@ -35,25 +40,47 @@ extern void setGdt(u16 limit, u64 base);
 extern void reloadSegments();
 extern void setTSS();
 
-static u64 gdt[7];
+PERCPU static u64 gdt_entries[GDT_ENTRIES];
+PERCPU static TSS* cpu_tss;
 
 void load_gdt() {
     // need to disable interrupts when setting gdt
     asm("cli");
 
-    // TODO: where should we put the gdt?
+    u64* gdt = *this_cpu_ptr(gdt_entries);
     gdt[0] = create_gdt_descriptor(0, 0, 0);
     gdt[1] = create_gdt_descriptor(0, 0x000FFFFF, 0xA09A);
     gdt[2] = create_gdt_descriptor(0, 0x000FFFFF, 0xC092);
     gdt[3] = create_gdt_descriptor(0, 0x000FFFFF, 0xC0F2);
     gdt[4] = create_gdt_descriptor(0, 0x000FFFFF, 0xA0FA);
 
-    // TODO: what should esp0 be? This will be the value of the stack pointer when switching to ring0
-    TSS tss = {.ss0 = 0x10, .esp0 = 0, .iomap = sizeof(TSS)};
-    create_tss_descriptor(gdt + 5, (u64)&tss, sizeof(tss)-1, 0x4089);
+    // the TSS has to outlive this function, the CPU keeps referring to it
+    TSS* tss = kmalloc(sizeof(TSS));
+    if (tss == NULL) {
+        hcf();
+    }
+    memset((void*)tss, 0, sizeof(TSS));
+    // the stack the CPU switches to when entering ring 0, the scheduler keeps it
+    // at the top of the running thread's stack
+    tss->rsp0 = 0;
+    tss->iomap = sizeof(TSS);
+    for (u32 i = 0; i < IST_STACKS; i++) {
+        void* stack = vmm_alloc(IST_STACK_SIZE);
+        if (stack == NULL) {
+            hcf();
+        }
+        tss->ist[i] = (u64)stack + IST_STACK_SIZE;
+    }
+    // available 64-bit TSS
+    create_tss_descriptor(gdt + 5, (u64)tss, sizeof(TSS)-1, 0x0089);
+    this_cpu_write(cpu_tss, tss);
 
-    setGdt(7*8, (u64)gdt);
+    setGdt(GDT_ENTRIES*8, (u64)gdt);
     reloadSegments();
     asm("sti");
     setTSS();
 }
+
+void tss_set_rsp0(u64 rsp0) {
+    this_cpu_read(cpu_tss)->rsp0 = rsp0;
+}
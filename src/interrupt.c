@@ -2,8 +2,28 @@
 #include "utils.h"
 #include "string.h"
 #include "keyboard.h"
+#include "exception.h"
+#include "display.h"
+#include "apic.h"
+#include "clockevent.h"
+#include "time.h"
+#include "timer.h"
+#include "cpu.h"
+#include "spinlock.h"
+#include "sched.h"
+#include "softirq.h"
+#include "percpu.h"
+
+#define EXCEPTION_VECTORS 32
+#define BENCH_VECTOR 0x80
 
 static InterruptDescriptor idt[256];
+static InterruptHandler handlers[256];
+// interrupts nobody registered for, per vector
+static u64 unexpected[256];
+
+// entry stubs in asm_utils.asm
+extern u64 interruptStubs[256];
 
 void PIC_sendEOI(u8 irq)
 {
@@ -13,6 +33,17 @@ void PIC_sendEOI(u8 irq)
 	outb(PIC1_COMMAND,PIC_EOI);
 }
 
+// Set once the IOAPIC delivers the ISA IRQs instead of the 8259
+static bool apic_mode = false;
+
+void send_eoi(u8 irq) {
+    if (apic_mode) {
+        lapic_eoi();
+    } else {
+        PIC_sendEOI(irq);
+    }
+}
+
 void PIC_remap(i32 offset1, i32 offset2)
 {
 	outb(PIC1_COMMAND, ICW1_INIT | ICW1_ICW4);
@@ -29,6 +60,11 @@ void PIC_remap(i32 offset1, i32 offset2)
 	outb(PIC2_DATA, 0);
 }
 
+void PIC_disable() {
+    outb(PIC1_DATA, 0xff);
+    outb(PIC2_DATA, 0xff);
+}
+
 void IRQ_set_mask(u8 line) {
     u16 port;
     u8 value;
@@ -87,9 +123,77 @@ void set_interrupt_descriptor(u8 i, u64 handler_addr) {
     idt[i] = desc;
 }
 
+void set_interrupt_ist(u8 vector, u8 ist) {
+    idt[vector].ist = ist;
+}
+
 void init_idt() {
     for (u64 i = 0; i < 256; i++) {
-        set_interrupt_descriptor(i, (u64)default_interrupt_handler);
+        set_interrupt_descriptor(i, interruptStubs[i]);
+        handlers[i] = default_interrupt_handler;
+    }
+}
+
+void set_interrupt_handler(u8 vector, InterruptHandler handler) {
+    handlers[vector] = handler;
+}
+
+bool irqoff_tracing;
+PERCPU static u64 irqoff_since;
+PERCPU static u64 irqoff_max;
+// where the longest stretch ended, or the vector whose handler it was
+PERCPU static u64 irqoff_max_site;
+
+void irqoff_trace_start() {
+    this_cpu_write(irqoff_since, rdtsc());
+}
+
+static void irqoff_trace_stop_at(u64 site) {
+    u64 since = this_cpu_read(irqoff_since);
+    if (since == 0) {
+        return;
+    }
+    this_cpu_write(irqoff_since, 0);
+    u64 cycles = rdtsc() - since;
+    if (cycles > this_cpu_read(irqoff_max)) {
+        this_cpu_write(irqoff_max, cycles);
+        this_cpu_write(irqoff_max_site, site);
+    }
+}
+
+void irqoff_trace_stop() {
+    irqoff_trace_stop_at((u64)__builtin_return_address(0));
+}
+
+void irqoff_trace_enable() {
+    irqoff_tracing = true;
+}
+
+// interruptCommon calls this for every vector
+void interrupt_dispatch(TrapFrame* frame) {
+    // exceptions belong to whatever raised them, only interrupts defer work and may switch threads
+    if (frame->vector < EXCEPTION_VECTORS) {
+        handlers[frame->vector](frame);
+        return;
+    }
+
+    bool trace = IRQOFF_TRACE && irqoff_tracing;
+    if (trace) {
+        irqoff_trace_start();
+    }
+    irq_enter();
+    handlers[frame->vector](frame);
+    if (trace) {
+        irqoff_trace_stop_at(frame->vector);
+    }
+    // softirqs run in here with interrupts enabled
+    irq_exit();
+    if (trace) {
+        irqoff_trace_start();
+    }
+    sched_preempt();
+    if (trace) {
+        irqoff_trace_stop();
     }
 }
 
@@ -109,77 +213,202 @@ void init_PIC() {
     set_PIT_frequency();
 }
 
-__attribute__((interrupt)) void default_interrupt_handler(struct interrupt_frame* frame) {
-    // TODO: Interrupt service routine should only call a function with attribute 'no_caller_saved_registers' or be compiled with '-mgeneral-regs-only'
-    u16 irr = pic_get_irr();
-    u16 isr = pic_get_isr();
-
+void default_interrupt_handler(TrapFrame* frame) {
     u8 buffer[64];
-    print_err(str8_lit("Interrupt\n  irr: "));
-    print_err(u64_to_str8_hex(irr, buffer, 64));
-    print_err(str8_lit("\n  isr: "));
-    print_err(u64_to_str8_hex(isr, buffer, 64));
-    print_err(str8_lit("\n"));
-
-    PIC_sendEOI(0);
-}
-
-static u64 ticks = 0;
-__attribute__((interrupt)) void timer_interrupt_handler(struct interrupt_frame* frame) {
-    if (ticks > 0) {
-        ticks--;
-    }
-    PIC_sendEOI(0);
-}
-
-__attribute__((interrupt)) void kb_interrupt_handler(struct interrupt_frame* frame) {
-    KeyCode code = readKeyCode();
-
-    if (code == keyCodeLShiftDown || code == keyCodeRShiftDown) {
-        keyboard_state.shift = true;
-    } else if (code == keyCodeLShiftUp || code == keyCodeRShiftUp) {
-        keyboard_state.shift = false;
-    } else if (code == keyCodeLControlDown || code == keyCodeRControlDown) {
-        keyboard_state.control = true;
-    } else if (code == keyCodeLControlUp || code == keyCodeRControlUp) {
-        keyboard_state.control = false;
-    } else if (code == keyCodeLMenuDown || code == keyCodeRMenuDown) {
-        keyboard_state.menu = true;
-    } else if (code == keyCodeLMenuUp || code == keyCodeRMenuUp) {
-        keyboard_state.menu = false;
-    }
-
-    if (code < N_SIMPLE_KEYCODES) {
-        u8 row = 0;
-        if (keyboard_state.shift) {
-            row = 1;
-        } else if (keyboard_state.menu) {
-            row = 2;
-        }
-        u8 ascii_code = ascii_codes[code + row*N_SIMPLE_KEYCODES];
-        if (ascii_code != 0) {
-            print(str8(&ascii_code, 1));
-        }
+    if (frame->vector < EXCEPTION_VECTORS) {
+        // the fault may have hit with the console lock held
+        display_bust_lock();
+        print_err(str8_lit("interrupt: unhandled exception "));
+        print_err(u64_to_str8_hex(frame->vector, buffer, 64));
+        print_err(str8_lit(" error "));
+        print_err(u64_to_str8_hex(frame->error_code, buffer, 64));
+        print_err(str8_lit(" rip "));
+        print_err(u64_to_str8_hex(frame->rip, buffer, 64));
+        print_err(str8_lit("\n"));
+        display_flush();
+        hcf();
+    }
+
+    if (__atomic_fetch_add(&unexpected[frame->vector], 1, __ATOMIC_RELAXED) == 0) {
+        print_err(str8_lit("interrupt: unexpected vector "));
+        print_err(u64_to_str8_hex(frame->vector, buffer, 64));
+        print_err(str8_lit("\n"));
     }
+    // the LAPIC's own spurious vector has a handler, anything else it delivered is in service
+    if (apic_mode) {
+        lapic_eoi();
+    } else if (frame->vector >= PIC1 && frame->vector < PIC2 + 8) {
+        PIC_sendEOI(frame->vector - PIC1);
+    }
+}
+
+static volatile u64 pit_interrupts = 0;
+
+// The wheel runs as a softirq, timer callbacks don't hold interrupts off
+void timer_event() {
+    softirq_raise(SOFTIRQ_TIMER);
+}
 
-    PIC_sendEOI(1);
+void timer_interrupt_handler(TrapFrame* frame) {
+    (void)frame;
+    pit_interrupts++;
+    timer_event();
+    send_eoi(0);
 }
 
+// Moves the timer and keyboard IRQs to the IOAPIC, the PIC stays in charge if that fails
+static void init_apic_routing() {
+    if (!init_apic()) {
+        return;
+    }
+
+    u64 flags = irq_save();
+    u32 bsp = lapic_id();
+    if (ioapic_route_irq(0, PIC1, bsp) && ioapic_route_irq(1, PIC1 + 1, bsp)) {
+        PIC_disable();
+        // nothing legitimate arrives through the 8259 anymore
+        lapic_write(LAPIC_LVT_LINT0, LVT_MASKED);
+        apic_mode = true;
+    } else {
+        ioapic_mask_irq(0);
+        ioapic_mask_irq(1);
+        print_err(str8_lit("apic: can't route ISA IRQs, keeping the PIC\n"));
+    }
+    irq_restore(flags);
+}
 
 extern void setIdt(u16 size, u64 base);
-void init_interrupts() {
+void load_idt() {
     setIdt(256*sizeof(InterruptDescriptor)-1, (u64)idt);
+}
+
+void init_interrupts() {
+    load_idt();
     init_idt();
 
-    set_interrupt_descriptor(PIC1, (u64)timer_interrupt_handler);
-    set_interrupt_descriptor(PIC1+1, (u64)kb_interrupt_handler);
+    set_interrupt_handler(PIC1, timer_interrupt_handler);
+    init_exceptions();
+    softirq_register(SOFTIRQ_TIMER, timer_run);
+    init_keyboard();
 
+    // the PIC is remapped even when it ends up masked, so its spurious IRQs can't look like exceptions
     init_PIC();
+    init_apic_routing();
+}
+
+static void wake_sleeper(void* data) {
+    *(volatile bool*)data = true;
 }
 
 void sleep(u64 millis) {
-    ticks = millis;
-    while (ticks > 0) {
-        asm("hlt");
+    // the timer interrupt may need any of them
+    lockdep_assert_none_held();
+    u64 deadline = ktime_ns() + millis * NS_PER_MS;
+    // threads give the CPU to others, the idle thread and early boot halt instead
+    if (thread_sleep_until(deadline)) {
+        return;
+    }
+    volatile bool done = false;
+    Timer timer;
+    timer_init(&timer, wake_sleeper, (void*)&done);
+    timer_add(&timer, deadline);
+    // the timer needs interrupts either way, the caller gets back the state it had
+    u64 flags = irq_save();
+    while (!done) {
+        // sti takes effect after the next instruction, so the interrupt can't slip in before the hlt
+        asm volatile("sti; hlt; cli" : : : "memory");
+    }
+    irq_restore(flags);
+}
+
+u64 uptime_ms() {
+    return ktime_ns() / NS_PER_MS;
+}
+
+static u64 timer_interrupts() {
+    return pit_interrupts + clockevent_interrupts();
+}
+
+#define IDLE_MEASURE_MS 250
+
+static u64 idle_interrupts_per_second() {
+    u64 before = timer_interrupts();
+    sleep(IDLE_MEASURE_MS);
+    return (timer_interrupts() - before) * 1000 / IDLE_MEASURE_MS;
+}
+
+void init_timer() {
+    u64 periodic = idle_interrupts_per_second();
+    if (!init_clockevent()) {
+        print_err(str8_lit("timer: no LAPIC timer, keeping the 1000 Hz PIT\n"));
+        return;
+    }
+
+    u64 flags = irq_save();
+    if (apic_mode) {
+        ioapic_mask_irq(0);
+    } else {
+        IRQ_set_mask(0);
+    }
+    irq_restore(flags);
+    // timers armed while the PIT was ticking need the clockevent now
+    softirq_raise(SOFTIRQ_TIMER);
+
+    u64 tickless = idle_interrupts_per_second();
+    print(str8_lit("timer: idle interrupts/s periodic="));
+    print_u64(periodic);
+    print(str8_lit(" tickless="));
+    print_u64(tickless);
+    print(str8_lit("\n"));
+}
+
+#define BENCH_INTERRUPTS 100000
+
+static u64 bench_interrupts;
+
+static void bench_interrupt_handler(TrapFrame* frame) {
+    (void)frame;
+    bench_interrupts++;
+}
+
+void interrupt_benchmark() {
+    set_interrupt_handler(BENCH_VECTOR, bench_interrupt_handler);
+    u64 start = cycles_begin();
+    for (u64 i = 0; i < BENCH_INTERRUPTS; i++) {
+        asm volatile("int %0" : : "i"(BENCH_VECTOR) : "memory");
+    }
+    u64 cycles = (cycles_end() - start) / BENCH_INTERRUPTS;
+    set_interrupt_handler(BENCH_VECTOR, default_interrupt_handler);
+
+    print(str8_lit("interrupt: int+dispatch+iretq "));
+    print_u64(cycles);
+    print(str8_lit(" cycles, "));
+    print_u64(bench_interrupts);
+    print(str8_lit(" handled\n"));
+}
+
+void irqoff_print_stats() {
+    u64 max = 0;
+    u64 site = 0;
+    u32 cpu = 0;
+    for_each_cpu(i) {
+        if (*per_cpu_ptr(irqoff_max, i) > max) {
+            max = *per_cpu_ptr(irqoff_max, i);
+            site = *per_cpu_ptr(irqoff_max_site, i);
+            cpu = i;
+        }
+    }
+
+    u8 buffer[64];
+    print(str8_lit("irqoff: longest "));
+    print_u64(cycles_to_ns(max) / 1000);
+    print(str8_lit("us on cpu "));
+    print_u64(cpu);
+    if (site < 256) {
+        print(str8_lit(", in the handler of vector "));
+    } else {
+        print(str8_lit(", ended at "));
     }
+    print(u64_to_str8_hex(site, buffer, 64));
+    print(str8_lit("\n"));
 }
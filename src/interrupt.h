@@ -15,7 +15,18 @@ typedef struct InterruptDescriptor {
 #define INTERRUPT_GATE 0x8E
 #define TRAP_GATE 0x8F
 
-struct interrupt_frame;
+// What the entry stubs in asm_utils.asm leave on the stack, lowest address first
+typedef struct TrapFrame {
+    u64 r15, r14, r13, r12, r11, r10, r9, r8;
+    u64 rbp, rdi, rsi, rdx, rcx, rbx, rax;
+    u64 vector;
+    u64 error_code; // 0 for vectors without one
+    // pushed by the CPU
+    u64 rip, cs, rflags, rsp, ss;
+} TrapFrame;
+
+// Handlers run with interrupts disabled and acknowledge their own interrupt
+typedef void (*InterruptHandler)(TrapFrame* frame);
 
 #define PIC1 0x20 // address for master PIC
 #define PIC2 0x28 // address for slave PIC
@@ -29,6 +40,9 @@ struct interrupt_frame;
 
 void PIC_sendEOI(u8 irq);
 
+// Acknowledges irq at the LAPIC, or at the PIC when the APIC isn't in use
+void send_eoi(u8 irq);
+
 #define ICW1_ICW4 0x01 // Indicates that ICW4 will be present
 #define ICW1_INIT 0x10
 #define ICW4_8086 0x01 // 8086/88  mode
@@ -36,6 +50,9 @@ void PIC_sendEOI(u8 irq);
 
 void PIC_remap(i32 offset1, i32 offset2);
 
+// Masks every line, for when the IOAPIC takes over
+void PIC_disable();
+
 void IRQ_set_mask(u8 line);
 
 void IRQ_clear_mask(u8 line);
@@ -51,18 +68,48 @@ u16 pic_get_isr(void);
 
 void set_interrupt_descriptor(u8 i, u64 handler_addr);
 
+// Points every IDT entry at its entry stub and every vector at the default handler
 void init_idt();
 
+// init_idt() resets the table, so modules register after init_interrupts()
+void set_interrupt_handler(u8 vector, InterruptHandler handler);
+
+// Enters vector on stack ist of the CPU's TSS, 0 stays on the current stack
+void set_interrupt_ist(u8 vector, u8 ist);
+
 void set_PIT_frequency();
 
 void init_PIC();
 
-__attribute__((interrupt)) void default_interrupt_handler(struct interrupt_frame* frame);
+// Unhandled exceptions are fatal, unexpected interrupts are counted and reported once per vector.
+// init_exceptions() gives every exception a handler of its own.
+void default_interrupt_handler(TrapFrame* frame);
 
-__attribute__((interrupt)) void timer_interrupt_handler(struct interrupt_frame* frame);
+void timer_interrupt_handler(TrapFrame* frame);
 
-__attribute__((interrupt)) void kb_interrupt_handler(struct interrupt_frame* frame);
+// All CPUs share one IDT, every AP loads it for itself
+void load_idt();
 
 void init_interrupts();
 
+// Replaces the 1000 Hz PIT tick with the one-shot clockevent when there is one.
+// Needs init_time() and interrupts enabled, it measures the idle interrupt rate before and after.
+void init_timer();
+
+// The work done on every timer interrupt, periodic or one-shot: raising the softirq
+// that runs the timer wheel
+void timer_event();
+
 void sleep(u64 millis);
+
+// Milliseconds since init_time(), see ktime_ns() for a finer clock
+u64 uptime_ms();
+
+// Cycles from an int instruction through the entry stub, dispatch and iretq
+void interrupt_benchmark();
+
+// Starts tracking the longest time any CPU runs with interrupts disabled. Boot
+// deliberately holds them off for calibration, so this starts once that is over.
+void irqoff_trace_enable();
+
+void irqoff_print_stats();
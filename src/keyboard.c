@@ -0,0 +1,253 @@
+#include "keyboard.h"
+#include "interrupt.h"
+#include "softirq.h"
+#include "sched.h"
+#include "time.h"
+#include "cpu.h"
+#include "display.h"
+#include "spinlock.h"
+#include "utils.h"
+
+#define KB_DATA 0x60
+#define KB_STATUS 0x64
+#define KB_STATUS_OUTPUT_FULL (1 << 0)
+
+// Bytes from the interrupt handler to the decoder softirq. It runs on the CPU IRQ 1
+// is routed to, and on the reader's when that finds bytes held back. Together with
+// the event ring that makes 512 keys of slack for bursts, a full ring holds the
+// decoder back instead of dropping anything.
+#define RAW_SIZE 256
+#define EVENT_SIZE 256
+
+// Rows of ascii_codes: plain, shift, AltGr
+static const u8 ascii_codes[] = {0, 0, '1', '2', '3', '4', '5', '6', '7', '8', '9', '0', '+', 0, 0, '\t', 'q', 'w', 'e', 'r', 't', 'y', 'u', 'i', 'o', 'p', 0, 0, 0, 0, 'a', 's', 'd', 'f', 'g', 'h', 'j', 'k', 'l', 0, 0, 0, 0, 0, 'z', 'x', 'c', 'v', 'b', 'n', 'm', ',', '.', '-', 0, '*', 0, ' ',
+                                  0, 0, '!', '"', '#',   0, '%', '&', '/', '(', ')', '=', '?', 0, 0,    0, 'Q', 'W', 'E', 'R', 'T', 'Y', 'U', 'I', 'O', 'P', 0, 0, 0, 0, 'A', 'S', 'D', 'F', 'G', 'H', 'J', 'K', 'L', 0, 0, 0, 0, 0, 'Z', 'X', 'C', 'V', 'B', 'N', 'M', ';', ':', '_', 0,   0, 0,   0,
+                                  0, 0,   0, '@',   0,   0,   0,   0, '{', '[', ']', '}', '\\',0, 0,    0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0, 0, 0, 0, 0,   0,   0,   0,   0,   0,   0,   0,   0,   0, 0, 0, 0, 0, 0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0, 0,   0, 0,   0};
+
+
+typedef enum DecoderState {
+    DECODE_START,
+    DECODE_E0,    // after the prefix of an extended key
+    DECODE_PAUSE, // inside E1 1D 45 E1 9D C5, which Pause sends on press only
+} DecoderState;
+
+// Each index has one writer: the handler or decoder moves head, the consumer tail
+static u8 raw_bytes[RAW_SIZE];
+static u64 raw_tsc[RAW_SIZE];
+static u32 raw_head;
+static u32 raw_tail;
+
+static KeyEvent events[EVENT_SIZE];
+static u32 event_head;
+static u32 event_tail;
+// blocked in keyboard_read()
+static Thread* reader;
+
+// one decoder at a time, it owns raw_tail, event_head and the state below
+static Spinlock decoder_lock = SPINLOCK_INIT("keyboard decoder");
+static DecoderState state = DECODE_START;
+static u32 pause_bytes;
+static u8 modifiers;
+
+static u64 raw_dropped;
+static u64 decoded;
+static u64 ignored;
+
+// A byte, a timestamp and the EOI, the rest waits for the softirq
+static void keyboard_interrupt_handler(TrapFrame* frame) {
+    (void)frame;
+    u32 head = raw_head;
+    u8 byte = inb(KB_DATA);
+    if (head - __atomic_load_n(&raw_tail, __ATOMIC_ACQUIRE) < RAW_SIZE) {
+        raw_bytes[head % RAW_SIZE] = byte;
+        raw_tsc[head % RAW_SIZE] = rdtsc();
+        __atomic_store_n(&raw_head, head + 1, __ATOMIC_RELEASE);
+    } else {
+        raw_dropped++;
+    }
+    send_eoi(1);
+    softirq_raise(SOFTIRQ_KEYBOARD);
+}
+
+static u8 modifier_bit(KeyCode code) {
+    switch (code) {
+    case keyCodeLShiftDown:
+    case keyCodeRShiftDown:
+        return KEY_MOD_SHIFT;
+    case keyCodeLControlDown:
+    case keyCodeRControlDown:
+        return KEY_MOD_CONTROL;
+    case keyCodeLMenuDown:
+    case keyCodeRMenuDown:
+        return KEY_MOD_MENU;
+    default:
+        return 0;
+    }
+}
+
+static void emit(KeyCode code, bool pressed, u64 tsc) {
+    u8 bit = modifier_bit(code);
+    if (pressed) {
+        modifiers |= bit;
+    } else {
+        modifiers &= ~bit;
+    }
+
+    u8 ascii = 0;
+    if (pressed && code < N_SIMPLE_KEYCODES) {
+        u8 row = 0;
+        if (modifiers & KEY_MOD_SHIFT) {
+            row = 1;
+        } else if (modifiers & KEY_MOD_MENU) {
+            row = 2;
+        }
+        ascii = ascii_codes[code + row*N_SIMPLE_KEYCODES];
+    }
+
+    u32 head = event_head;
+    events[head % EVENT_SIZE] = (KeyEvent){
+        .time = cycles_to_ns(tsc - ktime_tsc_base),
+        .code = code,
+        .pressed = pressed,
+        .modifiers = modifiers,
+        .ascii = ascii,
+    };
+    __atomic_store_n(&event_head, head + 1, __ATOMIC_RELEASE);
+    decoded++;
+
+    // pairs with keyboard_read(): either it sees the event or this sees it waiting
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    Thread* waiting = __atomic_load_n(&reader, __ATOMIC_RELAXED);
+    if (waiting != NULL) {
+        thread_wake(waiting);
+    }
+}
+
+// Set 1 scancodes, one byte at a time, as the 8042 delivers them
+static void decode(u8 byte, u64 tsc) {
+    switch (state) {
+    case DECODE_PAUSE:
+        if (--pause_bytes == 0) {
+            state = DECODE_START;
+            emit(keyCodePause, true, tsc);
+        }
+        return;
+    case DECODE_E0:
+        state = DECODE_START;
+        // the fake shifts around Print Screen and the keypad keys in num lock
+        if ((byte & 0x7f) == 0x2a || (byte & 0x7f) == 0x36) {
+            ignored++;
+            return;
+        }
+        emit((KeyCode)(0xe000 | (byte & 0x7f)), (byte & 0x80) == 0, tsc);
+        return;
+    case DECODE_START:
+        break;
+    }
+
+    if (byte == 0xe0) {
+        state = DECODE_E0;
+    } else if (byte == 0xe1) {
+        state = DECODE_PAUSE;
+        pause_bytes = 5;
+    } else if (byte == 0x00 || byte == 0xfa || byte == 0xfe || byte == 0xff) {
+        // errors, overruns and replies to commands
+        ignored++;
+    } else {
+        emit((KeyCode)(byte & 0x7f), (byte & 0x80) == 0, tsc);
+    }
+}
+
+static bool decodable() {
+    // a full event ring leaves the bytes where they are, the reader gets to them later
+    u32 raw_pending = __atomic_load_n(&raw_head, __ATOMIC_ACQUIRE) - __atomic_load_n(&raw_tail, __ATOMIC_RELAXED);
+    u32 events_queued = __atomic_load_n(&event_head, __ATOMIC_RELAXED) - __atomic_load_n(&event_tail, __ATOMIC_ACQUIRE);
+    return raw_pending != 0 && events_queued < EVENT_SIZE;
+}
+
+static void keyboard_softirq() {
+    // whoever holds the lock checks again after dropping it, so bytes that came
+    // in while it was busy aren't stranded
+    while (decodable()) {
+        if (!spin_trylock(&decoder_lock)) {
+            return;
+        }
+        u32 tail = raw_tail;
+        while (tail != __atomic_load_n(&raw_head, __ATOMIC_ACQUIRE)) {
+            if (event_head - __atomic_load_n(&event_tail, __ATOMIC_ACQUIRE) >= EVENT_SIZE) {
+                break;
+            }
+            decode(raw_bytes[tail % RAW_SIZE], raw_tsc[tail % RAW_SIZE]);
+            tail++;
+            __atomic_store_n(&raw_tail, tail, __ATOMIC_RELEASE);
+        }
+        spin_unlock(&decoder_lock);
+    }
+}
+
+void init_keyboard() {
+    set_interrupt_handler(PIC1 + 1, keyboard_interrupt_handler);
+    softirq_register(SOFTIRQ_KEYBOARD, keyboard_softirq);
+    // a byte left over from the firmware would keep the edge triggered IRQ from firing again
+    while (inb(KB_STATUS) & KB_STATUS_OUTPUT_FULL) {
+        inb(KB_DATA);
+    }
+}
+
+bool keyboard_poll(KeyEvent* event) {
+    u32 tail = event_tail;
+    if (tail == __atomic_load_n(&event_head, __ATOMIC_ACQUIRE)) {
+        return false;
+    }
+    *event = events[tail % EVENT_SIZE];
+    __atomic_store_n(&event_tail, tail + 1, __ATOMIC_RELEASE);
+    // the decoder may have stopped on a full ring, it runs here then, serialized
+    // with the one on the IRQ CPU by decoder_lock
+    if (__atomic_load_n(&raw_tail, __ATOMIC_RELAXED) != __atomic_load_n(&raw_head, __ATOMIC_RELAXED)) {
+        softirq_raise(SOFTIRQ_KEYBOARD);
+    }
+    return true;
+}
+
+KeyEvent keyboard_read() {
+    KeyEvent event;
+    while (!keyboard_poll(&event)) {
+        u64 flags = irq_save();
+        thread_prepare_block();
+        __atomic_store_n(&reader, thread_current(), __ATOMIC_SEQ_CST);
+        if (__atomic_load_n(&event_head, __ATOMIC_ACQUIRE) != event_tail) {
+            thread_cancel_block();
+        } else {
+            thread_block();
+        }
+        __atomic_store_n(&reader, NULL, __ATOMIC_RELAXED);
+        irq_restore(flags);
+    }
+    return event;
+}
+
+static void echo(void* arg) {
+    (void)arg;
+    for (;;) {
+        KeyEvent event = keyboard_read();
+        if (event.ascii != 0) {
+            print(str8(&event.ascii, 1));
+        }
+    }
+}
+
+void keyboard_start_echo() {
+    if (thread_create(str8_lit("keyboard echo"), echo, NULL) == NULL) {
+        print_err(str8_lit("keyboard: can't start the echo thread\n"));
+    }
+}
+
+void keyboard_print_stats() {
+    print(str8_lit("keyboard: events="));
+    print_u64(decoded);
+    print(str8_lit(" ignored bytes="));
+    print_u64(ignored);
+    print(str8_lit(" dropped bytes="));
+    print_u64(raw_dropped);
+    print(str8_lit("\n"));
+}
@@ -1,13 +1,9 @@
 #pragma once
 
 #include "types.h"
-#include "utils.h"
+#include <stdbool.h>
 
-// TODO: This is a super hacky quick way to just get this working, not an attempt at a good keyboard driver :)
 #define N_SIMPLE_KEYCODES 0x3A
-u8 ascii_codes[] = {0, 0, '1', '2', '3', '4', '5', '6', '7', '8', '9', '0', '+', 0, 0, '\t', 'q', 'w', 'e', 'r', 't', 'y', 'u', 'i', 'o', 'p', 0, 0, 0, 0, 'a', 's', 'd', 'f', 'g', 'h', 'j', 'k', 'l', 0, 0, 0, 0, 0, 'z', 'x', 'c', 'v', 'b', 'n', 'm', ',', '.', '-', 0, '*', 0, ' ',
-                      0, 0, '!', '"', '#',   0, '%', '&', '/', '(', ')', '=', '?', 0, 0,    0, 'Q', 'W', 'E', 'R', 'T', 'Y', 'U', 'I', 'O', 'P', 0, 0, 0, 0, 'A', 'S', 'D', 'F', 'G', 'H', 'J', 'K', 'L', 0, 0, 0, 0, 0, 'Z', 'X', 'C', 'V', 'B', 'N', 'M', ';', ':', '_', 0,   0, 0,   0,
-                      0, 0,   0, '@',   0,   0,   0,   0, '{', '[', ']', '}', '\\',0, 0,    0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0, 0, 0, 0, 0,   0,   0,   0,   0,   0,   0,   0,   0,   0, 0, 0, 0, 0, 0,   0,   0,   0,   0,   0,   0,   0,   0,   0,   0, 0,   0, 0,   0};
 
 typedef enum KeyCode {
     keyCodeUndefined = 0x00,
@@ -113,20 +109,29 @@ typedef enum KeyCode {
     keyCodePause = 0xE11D
 } KeyCode;
 
-typedef struct KeyboardState {
-   bool shift;
-   bool control;
-   bool menu;
-} KeyboardState;
+#define KEY_MOD_SHIFT (1 << 0)
+#define KEY_MOD_CONTROL (1 << 1)
+#define KEY_MOD_MENU (1 << 2)
 
-KeyboardState keyboard_state;
+typedef struct KeyEvent {
+    u64 time;      // ktime_ns when the interrupt delivered the event's last byte
+    KeyCode code;  // the make code, releases included: keyCodeLShiftDown for both directions
+    bool pressed;
+    u8 modifiers;  // KEY_MOD_* after this event
+    u8 ascii;      // 0 for releases and keys without a character
+} KeyEvent;
 
-KeyCode readKeyCode() {
-    u8 byte1 = inb(0x60);
-    if (byte1 != 0xE0) {
-        return (KeyCode)byte1;
-    } else {
-        u8 byte2 = inb(0x60);
-        return (KeyCode)((byte1 << 8) | byte2);
-    }
-}
+// Takes over IRQ 1 and empties the controller's output buffer. Runs in init_interrupts().
+void init_keyboard();
+
+// Takes the oldest event, false if there is none. The reader may run on any CPU,
+// not only the one IRQ 1 is routed to.
+bool keyboard_poll(KeyEvent* event);
+
+// Blocks the calling thread until an event arrives. There may only be one reader.
+KeyEvent keyboard_read();
+
+// A thread that prints what is typed
+void keyboard_start_echo();
+
+void keyboard_print_stats();
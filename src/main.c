@@ -5,6 +5,21 @@
 #include "interrupt.h"
 #include "display.h"
 #include "gdt.h"
+#include "pmm.h"
+#include "slab.h"
+#include "vmm.h"
+#include "fpu.h"
+#include "acpi.h"
+#include "time.h"
+#include "timer.h"
+#include "smp.h"
+#include "percpu.h"
+#include "spinlock.h"
+#include "sched.h"
+#include "task.h"
+#include "softirq.h"
+#include "keyboard.h"
+#include "exception.h"
 
 __attribute__((used, section(".limine_requests")))
 static volatile uint64_t limine_base_revision[] = LIMINE_BASE_REVISION(4);
@@ -48,11 +63,80 @@ void kmain(void) {
         hcf();
     }
 
+    init_percpu();
+
+    init_mem_routines();
+
+    init_pmm(memmap_request.response);
+
+    init_vmm(memmap_request.response);
+
+    init_slab();
+
     init_display();
 
+    if (!init_acpi()) {
+        print_err(str8_lit("acpi: no tables, staying on the PIC\n"));
+    }
+
+    init_time();
+
+    display_benchmark_write_combining();
+
     load_gdt();
 
     init_interrupts();
 
-    hcf();
+    init_fpu();
+
+    init_timer();
+
+    init_sched();
+
+    init_smp();
+
+    irqoff_trace_enable();
+
+    keyboard_start_echo();
+
+    display_benchmark_glyphs();
+
+    mem_benchmark();
+
+    vmm_benchmark();
+
+    interrupt_benchmark();
+
+    timer_benchmark();
+
+    lock_benchmark();
+
+    sched_benchmark();
+
+    task_benchmark();
+
+    pmm_self_test();
+
+    slab_print_stats();
+
+    vmm_print_stats();
+
+    fpu_print_stats();
+
+    timer_print_stats();
+
+    sched_print_stats();
+
+    task_print_stats();
+
+    softirq_print_stats();
+
+    irqoff_print_stats();
+
+    keyboard_print_stats();
+
+    exception_print_stats();
+
+    // the BSP carries on with its idle thread, typed keys still get echoed
+    thread_exit();
 }
@@ -0,0 +1,48 @@
+#include "percpu.h"
+#include "vmm.h"
+#include "utils.h"
+
+#define MSR_GS_BASE 0xc0000101
+#define MSR_KERNEL_GS_BASE 0xc0000102
+
+extern u8 percpu_start[];
+extern u8 percpu_end[];
+
+PERCPU u32 percpu_cpu_number;
+PERCPU u64 percpu_offset;
+u64 percpu_offsets[MAX_CPUS];
+u32 percpu_cpus = 1;
+
+static void load_gs_base(u64 offset) {
+    wrmsr(MSR_GS_BASE, offset);
+    // what swapgs exchanges it with on entry from user mode, there is none yet
+    wrmsr(MSR_KERNEL_GS_BASE, 0);
+}
+
+void init_percpu() {
+    percpu_offsets[0] = 0;
+    load_gs_base(0);
+}
+
+bool percpu_alloc(u32 cpu) {
+    u64 size = percpu_end - percpu_start;
+    // page aligned, so no line is shared with another CPU's area
+    u8* area = vmm_alloc(size);
+    if (area == NULL) {
+        return false;
+    }
+    memset(area, 0, size);
+
+    u64 offset = area - percpu_start;
+    *(u32*)((u8*)&percpu_cpu_number + offset) = cpu;
+    *(u64*)((u8*)&percpu_offset + offset) = offset;
+    percpu_offsets[cpu] = offset;
+    if (cpu >= percpu_cpus) {
+        percpu_cpus = cpu + 1;
+    }
+    return true;
+}
+
+void init_percpu_cpu(u32 cpu) {
+    load_gs_base(percpu_offsets[cpu]);
+}
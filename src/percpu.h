@@ -0,0 +1,59 @@
+#pragma once
+
+#include "types.h"
+#include "cpu.h"
+#include <stdbool.h>
+
+// Per-CPU variables live in the .percpu section, which is the BSP's copy. Every AP
+// gets a zeroed copy of its own, set them up in the *_cpu() init functions. Each
+// variable starts a cache line so neighbours written by different code don't share one.
+#define PERCPU __attribute__((section(".percpu"), aligned(CACHE_LINE_SIZE)))
+
+// GS_BASE holds the distance from the .percpu section to the running CPU's copy, so
+// a variable's link address is its %gs-relative address. Accesses are single
+// instructions and can't be torn by an interrupt, but they are no barriers.
+#define this_cpu_read(var) ({                                       \
+    __typeof__(var) value_;                                         \
+    asm volatile("mov %%gs:%1, %0" : "=r"(value_) : "m"(var));      \
+    value_;                                                         \
+})
+
+#define this_cpu_write(var, value) \
+    asm volatile("mov%z0 %1, %%gs:%0" : "=m"(var) : "er"((__typeof__(var))(value)))
+
+#define this_cpu_add(var, value) \
+    asm volatile("add%z0 %1, %%gs:%0" : "+m"(var) : "er"((__typeof__(var))(value)))
+
+#define this_cpu_inc(var) this_cpu_add(var, 1)
+
+#define this_cpu_or(var, value) \
+    asm volatile("or%z0 %1, %%gs:%0" : "+m"(var) : "er"((__typeof__(var))(value)))
+
+#define this_cpu_dec(var) \
+    asm volatile("sub%z0 $1, %%gs:%0" : "+m"(var))
+
+extern PERCPU u32 percpu_cpu_number;
+extern PERCPU u64 percpu_offset;
+extern u64 percpu_offsets[MAX_CPUS];
+// CPUs that have a per-CPU area
+extern u32 percpu_cpus;
+
+// For structs and arrays, which don't fit the accessors above
+#define this_cpu_ptr(var) ((__typeof__(var)*)((u8*)&(var) + this_cpu_read(percpu_offset)))
+
+#define per_cpu_ptr(var, cpu) ((__typeof__(var)*)((u8*)&(var) + percpu_offsets[cpu]))
+
+#define for_each_cpu(cpu) for (u32 cpu = 0; cpu < percpu_cpus; cpu++)
+
+static inline u32 current_cpu() {
+    return this_cpu_read(percpu_cpu_number);
+}
+
+// Points the BSP's GS at the .percpu section itself. Runs before anything touches per-CPU data.
+void init_percpu();
+
+// Allocates the area of an AP, on the BSP before the AP is started
+bool percpu_alloc(u32 cpu);
+
+// Loads the GS base of an AP whose area percpu_alloc() made
+void init_percpu_cpu(u32 cpu);
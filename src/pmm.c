@@ -0,0 +1,497 @@
+#include "pmm.h"
+#include "utils.h"
+#include "display.h"
+#include "time.h"
+#include "cpu.h"
+#include "percpu.h"
+#include "spinlock.h"
+#include "task.h"
+
+__attribute__((used, section(".limine_requests")))
+static volatile struct limine_hhdm_request hhdm_request = {
+    .id = LIMINE_HHDM_REQUEST_ID,
+    .revision = 0,
+    .response = NULL
+};
+
+// Physical frames are tracked by a buddy allocator. The only per-frame metadata is
+// one byte, the rest lives inside the free blocks themselves: every free block
+// stores its free list links in its first bytes (through the hhdm).
+//
+// Only the first frame of a block carries state:
+//   PMM_FREE | order       head of a free block on free_areas[order]
+//   PMM_ALLOCATED | order  head of an allocated block
+//   0                      reserved, or not the head of a block
+#define PMM_FREE 0x80
+#define PMM_ALLOCATED 0x40
+#define PMM_ORDER_MASK 0x0f
+
+typedef struct FreeBlock {
+    struct FreeBlock* next;
+    struct FreeBlock* prev;
+} FreeBlock;
+
+typedef struct FreeArea {
+    FreeBlock* head;
+    u64 count;
+} FreeArea;
+
+u64 hhdm_offset;
+
+static u8* frame_meta;
+static u64 frame_count;
+static FreeArea free_areas[PMM_ORDERS];
+// bit n is set when free_areas[n] is not empty, so finding a block is a single bsf
+static u32 nonempty_orders;
+static u64 free_pages;
+static u64 total_pages;
+
+// Single pages are served from per-CPU magazines that refill from and drain to the
+// buddy allocator PCP_BATCH frames at a time, so the common path only disables
+// interrupts on the local CPU and stays within its own cache lines.
+#define PCP_MAGAZINE_SIZE 64
+#define PCP_BATCH 32
+
+typedef struct PageCache {
+    u64 count;
+    u64 frames[PCP_MAGAZINE_SIZE];
+
+    u64 allocs;
+    u64 alloc_hits;
+    u64 frees;
+    u64 free_hits;
+    u64 refills;
+    u64 drains;
+} __attribute__((aligned(CACHE_LINE_SIZE))) PageCache;
+
+PERCPU static PageCache page_cache;
+
+// Guards the free areas. Per-CPU caches keep most page traffic away from it,
+// refills and drains that do reach it queue up instead of bouncing the lock line.
+static McsLock buddy_lock = MCS_LOCK_INIT("buddy");
+
+static inline FreeBlock* frame_to_block(u64 frame) {
+    return (FreeBlock*)phys_to_virt(frame << PAGE_SHIFT);
+}
+
+static inline u64 block_to_frame(FreeBlock* block) {
+    return virt_to_phys(block) >> PAGE_SHIFT;
+}
+
+static void free_area_push(u64 frame, u32 order) {
+    FreeBlock* block = frame_to_block(frame);
+    FreeArea* area = &free_areas[order];
+
+    block->prev = NULL;
+    block->next = area->head;
+    if (area->head != NULL) {
+        area->head->prev = block;
+    }
+    area->head = block;
+    area->count++;
+    nonempty_orders |= 1u << order;
+    frame_meta[frame] = PMM_FREE | order;
+}
+
+static void free_area_remove(u64 frame, u32 order) {
+    FreeBlock* block = frame_to_block(frame);
+    FreeArea* area = &free_areas[order];
+
+    if (block->prev != NULL) {
+        block->prev->next = block->next;
+    } else {
+        area->head = block->next;
+    }
+    if (block->next != NULL) {
+        block->next->prev = block->prev;
+    }
+    area->count--;
+    if (area->head == NULL) {
+        nonempty_orders &= ~(1u << order);
+    }
+    frame_meta[frame] = 0;
+}
+
+static u64 free_area_pop(u32 order) {
+    u64 frame = block_to_frame(free_areas[order].head);
+    free_area_remove(frame, order);
+    return frame;
+}
+
+static void free_block(u64 frame, u32 order) {
+    while (order < PMM_MAX_ORDER) {
+        u64 buddy = frame ^ (1ull << order);
+        if (buddy >= frame_count || frame_meta[buddy] != (PMM_FREE | order)) {
+            break;
+        }
+        free_area_remove(buddy, order);
+        frame &= ~(1ull << order);
+        order++;
+    }
+    free_area_push(frame, order);
+}
+
+// Hands [start, end) to the allocator as the largest naturally aligned blocks that fit
+static void add_frame_range(u64 start, u64 end) {
+    // frame 0 is never handed out so that 0 can mean "no memory"
+    if (start == 0) {
+        start = 1;
+    }
+
+    while (start < end) {
+        u32 order = PMM_MAX_ORDER;
+        while (order > 0 && ((start & ((1ull << order) - 1)) != 0 || start + (1ull << order) > end)) {
+            order--;
+        }
+        free_block(start, order);
+        free_pages += 1ull << order;
+        total_pages += 1ull << order;
+        start += 1ull << order;
+    }
+}
+
+void init_pmm(struct limine_memmap_response* memmap) {
+    if (memmap == NULL || memmap->entry_count < 1
+     || hhdm_request.response == NULL) {
+        hcf();
+    }
+    hhdm_offset = hhdm_request.response->offset;
+
+    struct limine_memmap_entry* largest = NULL;
+    u64 highest_usable = 0;
+    for (u64 i = 0; i < memmap->entry_count; i++) {
+        struct limine_memmap_entry* entry = memmap->entries[i];
+        if (entry->type != LIMINE_MEMMAP_USABLE) {
+            continue;
+        }
+        if (entry->base + entry->length > highest_usable) {
+            highest_usable = entry->base + entry->length;
+        }
+        if (largest == NULL || entry->length > largest->length) {
+            largest = entry;
+        }
+    }
+
+    frame_count = highest_usable >> PAGE_SHIFT;
+    u64 meta_pages = (frame_count + PAGE_SIZE - 1) / PAGE_SIZE;
+    if (largest == NULL || largest->length < (meta_pages + 1) * PAGE_SIZE) {
+        print_err(str8_lit("pmm: no room for frame metadata\n"));
+        hcf();
+    }
+
+    // the metadata lives at the start of the largest usable region
+    frame_meta = phys_to_virt(largest->base);
+    memset(frame_meta, 0, frame_count);
+
+    for (u64 i = 0; i < memmap->entry_count; i++) {
+        struct limine_memmap_entry* entry = memmap->entries[i];
+        if (entry->type != LIMINE_MEMMAP_USABLE) {
+            continue;
+        }
+        u64 start = entry->base >> PAGE_SHIFT;
+        u64 end = (entry->base + entry->length) >> PAGE_SHIFT;
+        if (entry == largest) {
+            start += meta_pages;
+        }
+        add_frame_range(start, end);
+    }
+}
+
+static u64 buddy_alloc(u32 order) {
+    u32 candidates = nonempty_orders >> order;
+    if (candidates == 0) {
+        return 0;
+    }
+    u32 current = order + __builtin_ctz(candidates);
+    u64 frame = free_area_pop(current);
+
+    // split off the upper halves until the block has the requested size
+    while (current > order) {
+        current--;
+        free_area_push(frame + (1ull << current), current);
+    }
+
+    frame_meta[frame] = PMM_ALLOCATED | order;
+    free_pages -= 1ull << order;
+    return frame << PAGE_SHIFT;
+}
+
+static void buddy_free(u64 phys, u32 order) {
+    u64 frame = phys >> PAGE_SHIFT;
+    if (frame >= frame_count || frame_meta[frame] != (PMM_ALLOCATED | order)) {
+        u8 buffer[64];
+        print_err(str8_lit("pmm: bad free of "));
+        print_err(u64_to_str8_hex(phys, buffer, 64));
+        print_err(str8_lit("\n"));
+        return;
+    }
+
+    free_pages += 1ull << order;
+    free_block(frame, order);
+}
+
+u64 pmm_alloc(u32 order) {
+    if (order > PMM_MAX_ORDER) {
+        return 0;
+    }
+
+    McsNode node;
+    u64 flags = mcs_lock_irqsave(&buddy_lock, &node);
+    u64 phys = buddy_alloc(order);
+    mcs_unlock_irqrestore(&buddy_lock, &node, flags);
+    return phys;
+}
+
+void pmm_free(u64 phys, u32 order) {
+    McsNode node;
+    u64 flags = mcs_lock_irqsave(&buddy_lock, &node);
+    buddy_free(phys, order);
+    mcs_unlock_irqrestore(&buddy_lock, &node, flags);
+}
+
+u32 pmm_block_order(u64 phys) {
+    u64 frame = phys >> PAGE_SHIFT;
+    if (frame >= frame_count || (frame_meta[frame] & PMM_ALLOCATED) == 0) {
+        return PMM_ORDERS;
+    }
+    return frame_meta[frame] & PMM_ORDER_MASK;
+}
+
+u64 pmm_alloc_page() {
+    u64 flags = irq_save();
+    PageCache* cache = this_cpu_ptr(page_cache);
+    cache->allocs++;
+
+    if (cache->count == 0) {
+        cache->refills++;
+        McsNode node;
+        mcs_lock(&buddy_lock, &node);
+        while (cache->count < PCP_BATCH) {
+            u64 phys = buddy_alloc(0);
+            if (phys == 0) {
+                break;
+            }
+            cache->frames[cache->count++] = phys;
+        }
+        mcs_unlock(&buddy_lock, &node);
+        if (cache->count == 0) {
+            irq_restore(flags);
+            return 0;
+        }
+    } else {
+        cache->alloc_hits++;
+    }
+
+    u64 phys = cache->frames[--cache->count];
+    irq_restore(flags);
+    return phys;
+}
+
+void pmm_free_page(u64 phys) {
+    u64 flags = irq_save();
+    PageCache* cache = this_cpu_ptr(page_cache);
+    cache->frees++;
+
+    if (cache->count == PCP_MAGAZINE_SIZE) {
+        cache->drains++;
+        // give back the oldest frames, the most recently freed ones are still cache hot
+        McsNode node;
+        mcs_lock(&buddy_lock, &node);
+        for (u64 i = 0; i < PCP_BATCH; i++) {
+            buddy_free(cache->frames[i], 0);
+        }
+        mcs_unlock(&buddy_lock, &node);
+        for (u64 i = PCP_BATCH; i < PCP_MAGAZINE_SIZE; i++) {
+            cache->frames[i - PCP_BATCH] = cache->frames[i];
+        }
+        cache->count -= PCP_BATCH;
+    } else {
+        cache->free_hits++;
+    }
+
+    cache->frames[cache->count++] = phys;
+    irq_restore(flags);
+}
+
+u64 pmm_free_page_count() {
+    u64 cached = 0;
+    for_each_cpu(i) {
+        cached += per_cpu_ptr(page_cache, i)->count;
+    }
+    return free_pages + cached;
+}
+
+u64 pmm_total_page_count() {
+    return total_pages;
+}
+
+u64 pmm_fragmentation(u32 order) {
+    if (free_pages == 0) {
+        return 0;
+    }
+
+    u64 usable = 0;
+    for (u32 i = order; i < PMM_ORDERS; i++) {
+        usable += free_areas[i].count << i;
+    }
+    return 100 - usable * 100 / free_pages;
+}
+
+void pmm_print_stats() {
+    print(str8_lit("pmm: free="));
+    print_u64(free_pages * PAGE_SIZE / 1024);
+    print(str8_lit("KiB total="));
+    print_u64(total_pages * PAGE_SIZE / 1024);
+    print(str8_lit("KiB metadata="));
+    print_u64(frame_count / 1024);
+    print(str8_lit("KiB\npmm: free blocks per order:"));
+    for (u32 i = 0; i < PMM_ORDERS; i++) {
+        print(str8_lit(" "));
+        print_u64(free_areas[i].count);
+    }
+    print(str8_lit("\npmm: fragmentation for max order blocks="));
+    print_u64(pmm_fragmentation(PMM_MAX_ORDER));
+    print(str8_lit("%\n"));
+}
+
+void pmm_print_page_cache_stats() {
+    for_each_cpu(i) {
+        PageCache* cache = per_cpu_ptr(page_cache, i);
+        if (cache->allocs == 0 && cache->frees == 0) {
+            continue;
+        }
+        print(str8_lit("pmm: cpu"));
+        print_u64(i);
+        print(str8_lit(" page cache alloc hits="));
+        print_u64(cache->alloc_hits * 100 / (cache->allocs ? cache->allocs : 1));
+        print(str8_lit("% free hits="));
+        print_u64(cache->free_hits * 100 / (cache->frees ? cache->frees : 1));
+        print(str8_lit("% refills="));
+        print_u64(cache->refills);
+        print(str8_lit(" drains="));
+        print_u64(cache->drains);
+        print(str8_lit(" cached="));
+        print_u64(cache->count);
+        print(str8_lit("\n"));
+    }
+}
+
+#define PMM_TEST_BLOCKS 4096
+#define PMM_TEST_ROUNDS 64
+
+static u64 xorshift64(u64* state) {
+    u64 x = *state;
+    x ^= x << 13;
+    x ^= x >> 7;
+    x ^= x << 17;
+    *state = x;
+    return x;
+}
+
+#define PMM_TEST_GRAIN 256
+
+typedef struct MixedTest {
+    u64* blocks;
+    bool ok;
+} MixedTest;
+
+// Mixed orders freed in a scattered sequence, every block is tagged with its index
+// to catch overlaps, including with the blocks other CPUs allocate meanwhile
+static void mixed_orders(u64 begin, u64 end, void* arg) {
+    MixedTest* test = arg;
+    u64* blocks = test->blocks;
+    bool ok = true;
+    u64 seed = 0x9e3779b97f4a7c15 ^ begin;
+    for (u64 i = begin; i < end; i++) {
+        u32 order = xorshift64(&seed) % 5;
+        u64 phys = pmm_alloc(order);
+        if (phys == 0) {
+            ok = false;
+            blocks[i] = 0;
+            continue;
+        }
+        *(u64*)phys_to_virt(phys) = i;
+        blocks[i] = phys | order;
+    }
+    for (u64 pass = 0; pass < 2; pass++) {
+        for (u64 i = begin + pass; i < end; i += 2) {
+            if (blocks[i] == 0) {
+                continue;
+            }
+            u64 phys = blocks[i] & ~(PAGE_SIZE - 1);
+            if (*(u64*)phys_to_virt(phys) != i) {
+                ok = false;
+            }
+            pmm_free(phys, blocks[i] & (PAGE_SIZE - 1));
+        }
+    }
+    if (!ok) {
+        __atomic_store_n(&test->ok, false, __ATOMIC_RELAXED);
+    }
+}
+
+void pmm_self_test() {
+    u64 free_before = pmm_free_page_count();
+
+    // the bookkeeping array for the test comes from the allocator itself
+    u32 array_order = 3;
+    u64 array_phys = pmm_alloc(array_order);
+    if (array_phys == 0) {
+        print_err(str8_lit("pmm self test: out of memory\n"));
+        return;
+    }
+    u64* blocks = phys_to_virt(array_phys);
+
+    // single page alloc/free throughput, through the buddy allocator and through the page cache
+    u64 start = ktime_ns();
+    for (u64 round = 0; round < PMM_TEST_ROUNDS; round++) {
+        for (u64 i = 0; i < PMM_TEST_BLOCKS; i++) {
+            blocks[i] = pmm_alloc(0);
+        }
+        for (u64 i = 0; i < PMM_TEST_BLOCKS; i++) {
+            pmm_free(blocks[i], 0);
+        }
+    }
+    u64 elapsed = ktime_ns() - start;
+    if (elapsed == 0) {
+        elapsed = 1;
+    }
+
+    start = ktime_ns();
+    for (u64 round = 0; round < PMM_TEST_ROUNDS; round++) {
+        for (u64 i = 0; i < PMM_TEST_BLOCKS; i++) {
+            blocks[i] = pmm_alloc_page();
+        }
+        for (u64 i = 0; i < PMM_TEST_BLOCKS; i++) {
+            pmm_free_page(blocks[i]);
+        }
+    }
+    u64 elapsed_cached = ktime_ns() - start;
+    if (elapsed_cached == 0) {
+        elapsed_cached = 1;
+    }
+    u64 ops = PMM_TEST_BLOCKS * PMM_TEST_ROUNDS;
+
+    // the throughput loops above measure one CPU, the overlap check spreads over all of them
+    MixedTest test = {blocks, true};
+    parallel_for(0, PMM_TEST_BLOCKS, PMM_TEST_GRAIN, mixed_orders, &test);
+    bool ok = test.ok;
+
+    pmm_free(array_phys, array_order);
+    if (pmm_free_page_count() != free_before) {
+        ok = false;
+    }
+
+    print(str8_lit("pmm self test: "));
+    print_u64(ops * NS_PER_SEC / elapsed);
+    print(str8_lit(" alloc+free/s, "));
+    print_u64(ops * NS_PER_SEC / elapsed_cached);
+    print(str8_lit(" alloc+free/s cached, "));
+    if (ok) {
+        print(str8_lit("ok\n"));
+    } else {
+        print_err(str8_lit("FAILED\n"));
+    }
+    pmm_print_stats();
+    pmm_print_page_cache_stats();
+}
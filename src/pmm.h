@@ -0,0 +1,50 @@
+#pragma once
+
+#include "types.h"
+#include "limine.h"
+
+#define PAGE_SIZE 4096
+#define PAGE_SHIFT 12
+
+// Largest buddy block is 2^PMM_MAX_ORDER pages (4 MiB)
+#define PMM_MAX_ORDER 10
+#define PMM_ORDERS (PMM_MAX_ORDER + 1)
+
+extern u64 hhdm_offset;
+
+// Only valid for physical memory reachable through the higher half direct map
+static inline void* phys_to_virt(u64 phys) {
+    return (void*)(phys + hhdm_offset);
+}
+
+static inline u64 virt_to_phys(void* virt) {
+    return (u64)virt - hhdm_offset;
+}
+
+void init_pmm(struct limine_memmap_response* memmap);
+
+// Returns the physical address of 2^order contiguous pages, or 0 when out of memory
+u64 pmm_alloc(u32 order);
+
+void pmm_free(u64 phys, u32 order);
+
+// Order of the allocated block starting at phys, PMM_ORDERS if there is none
+u32 pmm_block_order(u64 phys);
+
+// Single pages come from a per-CPU cache in front of the buddy allocator
+u64 pmm_alloc_page();
+
+void pmm_free_page(u64 phys);
+
+u64 pmm_free_page_count();
+
+u64 pmm_total_page_count();
+
+// Percentage of free memory that can not satisfy an allocation of the given order
+u64 pmm_fragmentation(u32 order);
+
+void pmm_print_stats();
+
+void pmm_print_page_cache_stats();
+
+void pmm_self_test();
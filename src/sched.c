@@ -0,0 +1,392 @@
+#include "sched.h"
+#include "cpu.h"
+#include "percpu.h"
+#include "spinlock.h"
+#include "timer.h"
+#include "time.h"
+#include "gdt.h"
+#include "vmm.h"
+#include "slab.h"
+#include "smp.h"
+#include "display.h"
+#include "utils.h"
+
+typedef struct RunQueue {
+    Spinlock lock; // head and tail, other CPUs append to them
+    Thread* head;
+    Thread* tail;
+    Thread* current;
+    Thread* idle; // runs when the queue is empty, never queued itself
+    Thread* dead; // exited, freed by the next thread once nothing runs on its stack
+    bool need_resched;
+    Timer slice;
+    u64 switches;
+    u64 preemptions;
+} RunQueue;
+
+PERCPU static RunQueue runqueue;
+static KmemCache* thread_cache;
+static bool running;
+static u64 next_id;
+static u64 created;
+
+// Pushes the callee-saved registers, stores rsp in *save_rsp and pops next's
+extern void switchContext(u64* save_rsp, u64 next_rsp);
+
+static void slice_expired(void* data) {
+    ((RunQueue*)data)->need_resched = true;
+}
+
+static void arm_slice(RunQueue* rq) {
+    if (!timer_pending(&rq->slice)) {
+        timer_add(&rq->slice, ktime_ns() + SCHED_SLICE_MS * NS_PER_MS);
+    }
+}
+
+static Thread* thread_alloc(String8 name) {
+    Thread* thread = kmem_cache_alloc(thread_cache);
+    if (thread == NULL) {
+        return NULL;
+    }
+    memset(thread, 0, sizeof(Thread));
+    thread->id = __atomic_fetch_add(&next_id, 1, __ATOMIC_RELAXED);
+    thread->name = name;
+    return thread;
+}
+
+static void thread_free(Thread* thread) {
+    if (thread->stack != NULL) {
+        vmm_free(thread->stack, KERNEL_STACK_SIZE);
+    }
+    if (thread->fpu != NULL) {
+        fpu_state_destroy(thread->fpu);
+    }
+    kmem_cache_free(thread_cache, thread);
+}
+
+// Runs on the new thread after every switch
+static void finish_switch() {
+    RunQueue* rq = this_cpu_ptr(runqueue);
+    Thread* dead = rq->dead;
+    if (dead != NULL) {
+        rq->dead = NULL;
+        thread_free(dead);
+    }
+}
+
+// Interrupts have to be disabled. The current thread goes back on the queue if it
+// is still running, blocked and dead ones just aren't picked again.
+static void schedule() {
+    RunQueue* rq = this_cpu_ptr(runqueue);
+    Thread* prev = rq->current;
+    rq->need_resched = false;
+
+    spin_lock(&rq->lock);
+    if (prev->state == THREAD_RUNNING && prev != rq->idle) {
+        prev->state = THREAD_READY;
+        prev->next = NULL;
+        if (rq->tail != NULL) {
+            rq->tail->next = prev;
+        } else {
+            rq->head = prev;
+        }
+        rq->tail = prev;
+    }
+    Thread* next = rq->head;
+    if (next != NULL) {
+        rq->head = next->next;
+        if (rq->head == NULL) {
+            rq->tail = NULL;
+        }
+    } else {
+        next = rq->idle;
+    }
+    bool others = rq->head != NULL;
+    spin_unlock(&rq->lock);
+
+    next->state = THREAD_RUNNING;
+    if (others) {
+        arm_slice(rq);
+    } else {
+        timer_cancel(&rq->slice);
+    }
+    if (next == prev) {
+        return;
+    }
+
+    rq->current = next;
+    rq->switches++;
+    if (next->fpu != NULL) {
+        fpu_switch(next->fpu);
+    }
+    if (next->stack != NULL) {
+        tss_set_rsp0((u64)next->stack + KERNEL_STACK_SIZE);
+    }
+    switchContext(&prev->rsp, next->rsp);
+    finish_switch();
+}
+
+// switchContext returns here the first time a thread runs
+static __attribute__((noreturn)) void thread_entry() {
+    finish_switch();
+    if (IRQOFF_TRACE && irqoff_tracing) {
+        irqoff_trace_stop();
+    }
+    asm volatile("sti");
+    Thread* self = this_cpu_ptr(runqueue)->current;
+    self->fn(self->arg);
+    thread_exit();
+}
+
+static Thread* thread_new(String8 name, ThreadFn fn, void* arg) {
+    Thread* thread = thread_alloc(name);
+    if (thread == NULL) {
+        return NULL;
+    }
+    thread->stack = vmm_alloc(KERNEL_STACK_SIZE);
+    thread->fpu = fpu_available() ? fpu_state_create() : NULL;
+    if (thread->stack == NULL || (fpu_available() && thread->fpu == NULL)) {
+        thread_free(thread);
+        return NULL;
+    }
+    thread->fn = fn;
+    thread->arg = arg;
+
+    // what switchContext pops: six callee-saved registers, then thread_entry as the
+    // return address, which then sees a null return address of its own
+    u64* top = (u64*)((u8*)thread->stack + KERNEL_STACK_SIZE);
+    *--top = 0;
+    *--top = (u64)thread_entry;
+    for (u32 i = 0; i < 6; i++) {
+        *--top = 0;
+    }
+    thread->rsp = (u64)top;
+    __atomic_fetch_add(&created, 1, __ATOMIC_RELAXED);
+    return thread;
+}
+
+static void make_ready(Thread* thread) {
+    RunQueue* rq = per_cpu_ptr(runqueue, thread->cpu);
+    u64 flags = spin_lock_irqsave(&rq->lock);
+    thread->state = THREAD_READY;
+    thread->next = NULL;
+    if (rq->tail != NULL) {
+        rq->tail->next = thread;
+    } else {
+        rq->head = thread;
+    }
+    rq->tail = thread;
+    spin_unlock_irqrestore(&rq->lock, flags);
+
+    if (thread->cpu != current_cpu()) {
+        // sched_preempt() in the IPI handler picks it up
+        smp_kick(thread->cpu);
+        return;
+    }
+    flags = irq_save();
+    if (rq->current == rq->idle) {
+        rq->need_resched = true;
+    } else {
+        arm_slice(rq);
+    }
+    irq_restore(flags);
+}
+
+static void idle_main(void* arg) {
+    (void)arg;
+    smp_idle();
+}
+
+static void runqueue_init(Thread* boot) {
+    RunQueue* rq = this_cpu_ptr(runqueue);
+    spin_init(&rq->lock, str8_lit("runqueue"));
+    timer_init(&rq->slice, slice_expired, rq);
+    boot->state = THREAD_RUNNING;
+    boot->cpu = current_cpu();
+    boot->fpu = fpu_current();
+    rq->current = boot;
+}
+
+void init_sched() {
+    thread_cache = kmem_cache_create(str8_lit("thread"), sizeof(Thread), 0, NULL);
+    Thread* kmain_thread = thread_cache != NULL ? thread_alloc(str8_lit("kmain")) : NULL;
+    Thread* idle = thread_new(str8_lit("idle"), idle_main, NULL);
+    if (kmain_thread == NULL || idle == NULL) {
+        print_err(str8_lit("sched: can't allocate the boot threads\n"));
+        hcf();
+    }
+    idle->cpu = current_cpu();
+    runqueue_init(kmain_thread);
+    this_cpu_ptr(runqueue)->idle = idle;
+    running = true;
+}
+
+void init_sched_cpu() {
+    Thread* idle = thread_alloc(str8_lit("idle"));
+    if (idle == NULL) {
+        print_err(str8_lit("sched: can't allocate an AP's idle thread\n"));
+        hcf();
+    }
+    runqueue_init(idle);
+    this_cpu_ptr(runqueue)->idle = idle;
+}
+
+Thread* thread_create_on(u32 cpu, String8 name, ThreadFn fn, void* arg) {
+    // nothing would ever run a thread queued on an AP that didn't come up
+    if (!smp_cpu_online(cpu)) {
+        return NULL;
+    }
+    Thread* thread = thread_new(name, fn, arg);
+    if (thread == NULL) {
+        return NULL;
+    }
+    thread->cpu = cpu;
+    make_ready(thread);
+    return thread;
+}
+
+Thread* thread_create(String8 name, ThreadFn fn, void* arg) {
+    return thread_create_on(current_cpu(), name, fn, arg);
+}
+
+Thread* thread_current() {
+    return this_cpu_ptr(runqueue)->current;
+}
+
+void thread_yield() {
+    lockdep_assert_none_held();
+    u64 flags = irq_save();
+    schedule();
+    irq_restore(flags);
+}
+
+void thread_exit() {
+    asm volatile("cli");
+    RunQueue* rq = this_cpu_ptr(runqueue);
+    rq->current->state = THREAD_DEAD;
+    rq->dead = rq->current;
+    schedule();
+    // never picked again
+    hcf();
+    __builtin_unreachable();
+}
+
+void thread_prepare_block() {
+    __atomic_store_n(&this_cpu_ptr(runqueue)->current->state, THREAD_BLOCKED, __ATOMIC_SEQ_CST);
+}
+
+void thread_block() {
+    lockdep_assert_none_held();
+    // a wakeup since the prepare left it READY and queued, schedule() then just moves on
+    schedule();
+}
+
+void thread_cancel_block() {
+    Thread* self = this_cpu_ptr(runqueue)->current;
+    ThreadState expected = THREAD_BLOCKED;
+    if (!__atomic_compare_exchange_n(&self->state, &expected, THREAD_RUNNING, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+        // already woken and queued, it has to come off the queue again
+        schedule();
+    }
+}
+
+void thread_wake(Thread* thread) {
+    ThreadState expected = THREAD_BLOCKED;
+    if (__atomic_compare_exchange_n(&thread->state, &expected, THREAD_READY, false, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED)) {
+        make_ready(thread);
+    }
+}
+
+static void sleep_expired(void* data) {
+    thread_wake(data);
+}
+
+bool thread_sleep_until(u64 deadline) {
+    RunQueue* rq = this_cpu_ptr(runqueue);
+    if (!running || rq->current == NULL || rq->current == rq->idle) {
+        return false;
+    }
+
+    Timer timer;
+    timer_init(&timer, sleep_expired, rq->current);
+    u64 flags = irq_save();
+    timer_add(&timer, deadline);
+    while (ktime_ns() < deadline) {
+        thread_prepare_block();
+        thread_block();
+    }
+    irq_restore(flags);
+    timer_cancel(&timer);
+    return true;
+}
+
+bool sched_work_pending() {
+    RunQueue* rq = this_cpu_ptr(runqueue);
+    return running && __atomic_load_n(&rq->head, __ATOMIC_RELAXED) != NULL;
+}
+
+void sched_preempt() {
+    RunQueue* rq = this_cpu_ptr(runqueue);
+    if (!running || rq->current == NULL || this_cpu_read(preempt_count) != 0) {
+        return;
+    }
+    if (rq->need_resched || (rq->current == rq->idle && rq->head != NULL)) {
+        rq->preemptions++;
+        schedule();
+    } else if (rq->head != NULL) {
+        // queued from another CPU while something was running here
+        arm_slice(rq);
+    }
+}
+
+#define BENCH_YIELDS 100000
+
+static void yield_loop(void* arg) {
+    (void)arg;
+    for (u64 i = 0; i < BENCH_YIELDS; i++) {
+        thread_yield();
+    }
+}
+
+void sched_benchmark() {
+    RunQueue* rq = this_cpu_ptr(runqueue);
+    if (thread_create(str8_lit("yield bench"), yield_loop, NULL) == NULL) {
+        print_err(str8_lit("sched benchmark: can't create a thread\n"));
+        return;
+    }
+    // the first switch to a new thread also faults in its stack and FPU state
+    thread_yield();
+
+    u64 switches = rq->switches;
+    u64 start = cycles_begin();
+    for (u64 i = 0; i < BENCH_YIELDS; i++) {
+        thread_yield();
+    }
+    u64 cycles = cycles_end() - start;
+    switches = rq->switches - switches;
+
+    print(str8_lit("sched: context switch "));
+    print_u64(switches != 0 ? cycles / switches : 0);
+    print(str8_lit(" cycles ("));
+    print_u64(switches);
+    print(str8_lit(" yields)\n"));
+}
+
+void sched_print_stats() {
+    print(str8_lit("sched: threads created="));
+    print_u64(created);
+    for_each_cpu(i) {
+        RunQueue* rq = per_cpu_ptr(runqueue, i);
+        if (rq->current == NULL) {
+            continue;
+        }
+        print(str8_lit(" cpu"));
+        print_u64(i);
+        print(str8_lit(" switches="));
+        print_u64(rq->switches);
+        print(str8_lit("/"));
+        print_u64(rq->preemptions);
+        print(str8_lit(" preempted"));
+    }
+    print(str8_lit("\n"));
+}
@@ -0,0 +1,75 @@
+#pragma once
+
+#include "types.h"
+#include "string.h"
+#include "fpu.h"
+#include <stdbool.h>
+
+typedef void (*ThreadFn)(void* arg);
+
+typedef enum ThreadState {
+    THREAD_READY,
+    THREAD_RUNNING,
+    THREAD_BLOCKED,
+    THREAD_DEAD,
+} ThreadState;
+
+typedef struct Thread {
+    u64 rsp; // saved by switchContext, has to stay the first field
+    struct Thread* next; // run queue link
+    ThreadState state;
+    u32 cpu;
+    u64 id;
+    String8 name;
+    void* stack; // NULL for the boot contexts, which run on the stack they started with
+    ThreadFn fn;
+    void* arg;
+    FpuState* fpu;
+} Thread;
+
+// Time a thread runs while others are ready before it gets preempted
+#define SCHED_SLICE_MS 10
+
+// Turns kmain into the BSP's first thread and gives the BSP an idle thread.
+// Needs kmalloc, the FPU and timers, and has to run before init_smp().
+void init_sched();
+
+// Makes the context an AP boots in that CPU's idle thread
+void init_sched_cpu();
+
+// Starts fn(arg) on the calling CPU, or on cpu. The Thread is freed once it exits.
+Thread* thread_create(String8 name, ThreadFn fn, void* arg);
+
+// NULL if cpu isn't online
+Thread* thread_create_on(u32 cpu, String8 name, ThreadFn fn, void* arg);
+
+Thread* thread_current();
+
+void thread_yield();
+
+__attribute__((noreturn)) void thread_exit();
+
+// Blocking takes two steps so a wakeup that comes in between isn't lost. With
+// interrupts disabled throughout:
+//   thread_prepare_block(); if (!condition) thread_block(); else thread_cancel_block();
+// thread_block() returns once thread_wake() was called after the prepare.
+void thread_prepare_block();
+void thread_block();
+void thread_cancel_block();
+
+void thread_wake(Thread* thread);
+
+// Blocks the current thread until ktime_ns() reaches deadline. Idle threads can't block.
+bool thread_sleep_until(u64 deadline);
+
+// True when threads other than the idle one wait on this CPU
+bool sched_work_pending();
+
+// interrupt_dispatch() calls this after every interrupt's handler, it switches threads
+// once the time slice is up
+void sched_preempt();
+
+// Cycles per context switch, measured with two threads yielding to each other
+void sched_benchmark();
+
+void sched_print_stats();
@@ -0,0 +1,316 @@
+#include "slab.h"
+#include "pmm.h"
+#include "cpu.h"
+#include "utils.h"
+#include "display.h"
+#include "spinlock.h"
+
+// Every slab is a single page with its header at the start, so the slab (and
+// cache) owning an object is found by masking the object address. Objects are
+// never page aligned, which lets kfree tell slab objects from page allocations.
+typedef struct Slab {
+    struct Slab* next;
+    struct Slab* prev;
+    KmemCache* cache;
+    void* free_list;
+    u32 in_use;
+    u32 capacity;
+} Slab;
+
+struct KmemCache {
+    String8 name;
+    u64 object_size;
+    u64 stride;
+    u64 first_offset;
+    // free objects are linked through the word at this offset, past the object
+    // itself when a constructor has to keep the object intact
+    u64 free_offset;
+    u32 objects_per_slab;
+    KmemCtor ctor;
+
+    // the slab lists and counters below
+    Spinlock lock;
+    Slab* partial;
+    Slab* full;
+    Slab* empty;
+
+    u64 allocs;
+    u64 frees;
+    u64 active;
+    u64 slabs;
+
+    KmemCache* next;
+};
+
+#define KMALLOC_MIN_SHIFT 3
+#define KMALLOC_MAX_SHIFT 10
+#define KMALLOC_MAX_SIZE (1 << KMALLOC_MAX_SHIFT)
+#define KMALLOC_CLASSES (KMALLOC_MAX_SHIFT - KMALLOC_MIN_SHIFT + 1)
+
+static KmemCache cache_cache;
+static KmemCache* kmalloc_caches[KMALLOC_CLASSES];
+static KmemCache* caches;
+static Spinlock caches_lock = SPINLOCK_INIT("kmem caches");
+
+static inline u64 align_up(u64 x, u64 align) {
+    return (x + align - 1) & ~(align - 1);
+}
+
+static void slab_list_push(Slab** list, Slab* slab) {
+    slab->prev = NULL;
+    slab->next = *list;
+    if (*list != NULL) {
+        (*list)->prev = slab;
+    }
+    *list = slab;
+}
+
+static void slab_list_remove(Slab** list, Slab* slab) {
+    if (slab->prev != NULL) {
+        slab->prev->next = slab->next;
+    } else {
+        *list = slab->next;
+    }
+    if (slab->next != NULL) {
+        slab->next->prev = slab->prev;
+    }
+}
+
+static inline void** free_link(KmemCache* cache, void* obj) {
+    return (void**)((u64)obj + cache->free_offset);
+}
+
+static void cache_setup(KmemCache* cache, String8 name, u64 size, u64 align, KmemCtor ctor) {
+    if (align == 0) {
+        align = CACHE_LINE_SIZE;
+    }
+    if (align < sizeof(void*)) {
+        align = sizeof(void*);
+    }
+
+    memset(cache, 0, sizeof(KmemCache));
+    cache->name = name;
+    cache->object_size = size;
+    cache->ctor = ctor;
+    cache->free_offset = ctor != NULL ? align_up(size, sizeof(void*)) : 0;
+    u64 footprint = cache->free_offset + sizeof(void*);
+    if (footprint < size) {
+        footprint = size;
+    }
+    cache->stride = align_up(footprint, align);
+    cache->first_offset = align_up(sizeof(Slab), align);
+    cache->objects_per_slab = (PAGE_SIZE - cache->first_offset) / cache->stride;
+    spin_init(&cache->lock, name);
+
+    u64 flags = spin_lock_irqsave(&caches_lock);
+    cache->next = caches;
+    caches = cache;
+    spin_unlock_irqrestore(&caches_lock, flags);
+}
+
+static Slab* slab_create(KmemCache* cache) {
+    u64 phys = pmm_alloc_page();
+    if (phys == 0) {
+        return NULL;
+    }
+
+    Slab* slab = phys_to_virt(phys);
+    slab->cache = cache;
+    slab->in_use = 0;
+    slab->capacity = cache->objects_per_slab;
+    slab->free_list = NULL;
+
+    // link the objects back to front so allocation walks the page in address order
+    for (u64 i = cache->objects_per_slab; i > 0; i--) {
+        void* obj = (void*)((u64)slab + cache->first_offset + (i - 1) * cache->stride);
+        if (cache->ctor != NULL) {
+            cache->ctor(obj);
+        }
+        *free_link(cache, obj) = slab->free_list;
+        slab->free_list = obj;
+    }
+
+    cache->slabs++;
+    return slab;
+}
+
+KmemCache* kmem_cache_create(String8 name, u64 size, u64 align, KmemCtor ctor) {
+    if (size == 0 || (align & (align - 1)) != 0) {
+        return NULL;
+    }
+
+    KmemCache* cache = kmem_cache_alloc(&cache_cache);
+    if (cache == NULL) {
+        return NULL;
+    }
+
+    cache_setup(cache, name, size, align, ctor);
+
+    if (cache->objects_per_slab == 0) {
+        print_err(str8_lit("slab: object too large for a slab\n"));
+        kmem_cache_free(&cache_cache, cache);
+        return NULL;
+    }
+    return cache;
+}
+
+void* kmem_cache_alloc(KmemCache* cache) {
+    u64 flags = spin_lock_irqsave(&cache->lock);
+
+    Slab* slab = cache->partial;
+    if (slab == NULL) {
+        slab = cache->empty;
+        if (slab != NULL) {
+            cache->empty = NULL;
+        } else {
+            slab = slab_create(cache);
+            if (slab == NULL) {
+                spin_unlock_irqrestore(&cache->lock, flags);
+                return NULL;
+            }
+        }
+        slab_list_push(&cache->partial, slab);
+    }
+
+    void* obj = slab->free_list;
+    slab->free_list = *free_link(cache, obj);
+    slab->in_use++;
+    if (slab->in_use == slab->capacity) {
+        slab_list_remove(&cache->partial, slab);
+        slab_list_push(&cache->full, slab);
+    }
+
+    cache->allocs++;
+    cache->active++;
+    spin_unlock_irqrestore(&cache->lock, flags);
+    return obj;
+}
+
+void kmem_cache_free(KmemCache* cache, void* obj) {
+    Slab* slab = (Slab*)((u64)obj & ~(u64)(PAGE_SIZE - 1));
+    if (slab->cache != cache) {
+        print_err(str8_lit("slab: object freed to the wrong cache\n"));
+        return;
+    }
+
+    u64 flags = spin_lock_irqsave(&cache->lock);
+
+    if (slab->in_use == slab->capacity) {
+        slab_list_remove(&cache->full, slab);
+        slab_list_push(&cache->partial, slab);
+    }
+
+    *free_link(cache, obj) = slab->free_list;
+    slab->free_list = obj;
+    slab->in_use--;
+
+    // keep one empty slab around so alloc/free at a slab boundary doesn't thrash the page allocator
+    Slab* release = NULL;
+    if (slab->in_use == 0) {
+        slab_list_remove(&cache->partial, slab);
+        if (cache->empty == NULL) {
+            cache->empty = slab;
+        } else {
+            release = slab;
+            cache->slabs--;
+        }
+    }
+
+    cache->frees++;
+    cache->active--;
+    spin_unlock_irqrestore(&cache->lock, flags);
+
+    if (release != NULL) {
+        pmm_free_page(virt_to_phys(release));
+    }
+}
+
+void* kmalloc(u64 size) {
+    if (size == 0) {
+        return NULL;
+    }
+
+    if (size > KMALLOC_MAX_SIZE) {
+        u32 order = 0;
+        while (((u64)PAGE_SIZE << order) < size) {
+            order++;
+        }
+        u64 phys = order == 0 ? pmm_alloc_page() : pmm_alloc(order);
+        return phys != 0 ? phys_to_virt(phys) : NULL;
+    }
+
+    u32 index = 0;
+    while ((1ull << (index + KMALLOC_MIN_SHIFT)) < size) {
+        index++;
+    }
+    return kmem_cache_alloc(kmalloc_caches[index]);
+}
+
+void kfree(void* ptr) {
+    if (ptr == NULL) {
+        return;
+    }
+
+    if (((u64)ptr & (PAGE_SIZE - 1)) == 0) {
+        u64 phys = virt_to_phys(ptr);
+        u32 order = pmm_block_order(phys);
+        if (order == 0) {
+            pmm_free_page(phys);
+        } else if (order < PMM_ORDERS) {
+            pmm_free(phys, order);
+        } else {
+            print_err(str8_lit("slab: kfree of unknown pointer\n"));
+        }
+        return;
+    }
+
+    Slab* slab = (Slab*)((u64)ptr & ~(u64)(PAGE_SIZE - 1));
+    kmem_cache_free(slab->cache, ptr);
+}
+
+static String8 kmalloc_names[KMALLOC_CLASSES] = {
+    STR8_INIT("kmalloc-8"),
+    STR8_INIT("kmalloc-16"),
+    STR8_INIT("kmalloc-32"),
+    STR8_INIT("kmalloc-64"),
+    STR8_INIT("kmalloc-128"),
+    STR8_INIT("kmalloc-256"),
+    STR8_INIT("kmalloc-512"),
+    STR8_INIT("kmalloc-1024"),
+};
+
+void init_slab() {
+    cache_setup(&cache_cache, str8_lit("kmem_cache"), sizeof(KmemCache), 0, NULL);
+
+    for (u32 i = 0; i < KMALLOC_CLASSES; i++) {
+        u64 size = 1ull << (i + KMALLOC_MIN_SHIFT);
+        // small classes are naturally aligned, the rest end up on cache line boundaries
+        kmalloc_caches[i] = kmem_cache_create(kmalloc_names[i], size, size < CACHE_LINE_SIZE ? size : 0, NULL);
+        if (kmalloc_caches[i] == NULL) {
+            hcf();
+        }
+    }
+}
+
+void slab_print_stats() {
+    for (KmemCache* cache = caches; cache != NULL; cache = cache->next) {
+        if (cache->allocs == 0) {
+            continue;
+        }
+        print(str8_lit("slab: "));
+        print(cache->name);
+        print(str8_lit(" size="));
+        print_u64(cache->object_size);
+        print(str8_lit(" stride="));
+        print_u64(cache->stride);
+        print(str8_lit(" active="));
+        print_u64(cache->active);
+        print(str8_lit(" slabs="));
+        print_u64(cache->slabs);
+        print(str8_lit(" allocs="));
+        print_u64(cache->allocs);
+        print(str8_lit(" frees="));
+        print_u64(cache->frees);
+        print(str8_lit("\n"));
+    }
+}
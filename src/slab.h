@@ -0,0 +1,24 @@
+#pragma once
+
+#include "types.h"
+#include "string.h"
+
+typedef void (*KmemCtor)(void* obj);
+
+typedef struct KmemCache KmemCache;
+
+// align == 0 places objects on cache line boundaries. The constructor runs once
+// when a slab is populated; objects must be freed back in their constructed state.
+KmemCache* kmem_cache_create(String8 name, u64 size, u64 align, KmemCtor ctor);
+
+void* kmem_cache_alloc(KmemCache* cache);
+
+void kmem_cache_free(KmemCache* cache, void* obj);
+
+void* kmalloc(u64 size);
+
+void kfree(void* ptr);
+
+void init_slab();
+
+void slab_print_stats();
@@ -0,0 +1,273 @@
+#include "smp.h"
+#include "cpu.h"
+#include "percpu.h"
+#include "apic.h"
+#include "gdt.h"
+#include "vmm.h"
+#include "pmm.h"
+#include "fpu.h"
+#include "clockevent.h"
+#include "interrupt.h"
+#include "sched.h"
+#include "task.h"
+#include "time.h"
+#include "display.h"
+#include "spinlock.h"
+#include "utils.h"
+#include "limine.h"
+
+#define AP_TIMEOUT_MS 1000
+// KERNEL_STACK_SIZE in pages, as a buddy order
+#define AP_STACK_ORDER 2
+
+__attribute__((used, section(".limine_requests")))
+static volatile struct limine_mp_request mp_request = {
+    .id = LIMINE_MP_REQUEST_ID,
+    .revision = 0,
+    .response = NULL,
+    .flags = LIMINE_MP_REQUEST_X86_64_X2APIC
+};
+
+typedef struct Cpu {
+    u32 apic_id;
+    bool online;
+    // mailbox of smp_run_on(), fn goes back to NULL once the work returned
+    SmpFn fn;
+    void* arg;
+} __attribute__((aligned(CACHE_LINE_SIZE))) Cpu;
+
+static Cpu cpus[MAX_CPUS];
+static u32 cpu_count = 1;
+
+// TLB shootdowns go out one at a time, each target acks by clearing its request
+static Spinlock shootdown_lock = SPINLOCK_INIT("shootdown");
+static u64 shootdown_address;
+static u64 shootdown_size;
+static u32 shootdown_pending;
+PERCPU static bool shootdown_requested;
+
+// Past this many pages one full flush is cheaper than an invlpg each
+#define FLUSH_ALL_PAGES 32
+
+static void flush_local(u64 virt, u64 size) {
+    if (size > FLUSH_ALL_PAGES * PAGE_SIZE) {
+        // toggling PGE drops global entries too, a CR3 reload would keep them
+        u64 cr4 = read_cr4();
+        write_cr4(cr4 & ~(u64)CR4_PGE);
+        write_cr4(cr4);
+        return;
+    }
+    for (u64 offset = 0; offset < size; offset += PAGE_SIZE) {
+        invlpg(virt + offset);
+    }
+}
+
+static void shootdown_ack() {
+    if (__atomic_load_n(this_cpu_ptr(shootdown_requested), __ATOMIC_ACQUIRE)) {
+        flush_local(shootdown_address, shootdown_size);
+        this_cpu_write(shootdown_requested, false);
+        __atomic_sub_fetch(&shootdown_pending, 1, __ATOMIC_RELEASE);
+    }
+}
+
+static void tlb_interrupt_handler(TrapFrame* frame) {
+    (void)frame;
+    shootdown_ack();
+    lapic_eoi();
+}
+
+static void wake_interrupt_handler(TrapFrame* frame) {
+    (void)frame;
+    // wakes the CPU from hlt, the idle loop checks its mailbox and interrupt_dispatch()
+    // switches to threads queued from elsewhere
+    lapic_eoi();
+}
+
+void smp_idle() {
+    Cpu* cpu = &cpus[current_cpu()];
+    for (;;) {
+        asm volatile("cli" : : : "memory");
+        SmpFn fn = __atomic_load_n(&cpu->fn, __ATOMIC_ACQUIRE);
+        if (fn == NULL) {
+            if (sched_work_pending()) {
+                asm volatile("sti" : : : "memory");
+                thread_yield();
+                continue;
+            }
+            if (!task_idle_enter()) {
+                asm volatile("sti" : : : "memory");
+                task_run_one();
+                continue;
+            }
+            // sti takes effect after the next instruction, so the IPI can't slip in before the hlt
+            asm volatile("sti; hlt" : : : "memory");
+            task_idle_exit();
+            continue;
+        }
+        asm volatile("sti" : : : "memory");
+        fn(cpu->arg);
+        __atomic_store_n(&cpu->fn, NULL, __ATOMIC_RELEASE);
+    }
+}
+
+// apEntry switched to the stack in extra_argument and calls this
+__attribute__((noreturn)) void ap_main(struct limine_mp_info* info) {
+    u32 index = 1;
+    while (index < cpu_count && cpus[index].apic_id != info->lapic_id) {
+        index++;
+    }
+    Cpu* cpu = &cpus[index];
+
+    // the per-CPU area is in vmalloc space, which only the kernel tables map
+    init_vmm_cpu();
+    init_percpu_cpu(index);
+    init_lapic_cpu();
+    // the IDT first, load_gdt() enables interrupts
+    load_idt();
+    load_gdt();
+    if (fpu_available()) {
+        init_fpu_cpu();
+        fpu_switch(fpu_state_create());
+    }
+    if (clockevent_active()) {
+        init_clockevent_cpu();
+    }
+    init_sched_cpu();
+
+    // the BSP prints for it, the console isn't safe to share yet
+    __atomic_store_n(&cpu->online, true, __ATOMIC_RELEASE);
+    smp_idle();
+}
+
+extern void apEntry(struct limine_mp_info* info);
+
+void init_smp() {
+    struct limine_mp_response* response = mp_request.response;
+    cpus[0].apic_id = apic_enabled() ? lapic_id() : 0;
+    cpus[0].online = true;
+    if (response == NULL || response->cpu_count <= 1) {
+        return;
+    }
+    if (!apic_enabled()) {
+        print_err(str8_lit("smp: no APIC, staying on the BSP\n"));
+        return;
+    }
+
+    set_interrupt_handler(IPI_WAKE_VECTOR, wake_interrupt_handler);
+    set_interrupt_handler(IPI_TLB_VECTOR, tlb_interrupt_handler);
+    if (response->cpu_count > MAX_CPUS) {
+        print_err(str8_lit("smp: more CPUs than MAX_CPUS, ignoring the rest\n"));
+    }
+
+    // one at a time, the APs share the gdtr/idtr scratch of asm_utils.asm while loading them
+    for (u64 i = 0; i < response->cpu_count && cpu_count < MAX_CPUS; i++) {
+        struct limine_mp_info* info = response->cpus[i];
+        if (info->lapic_id == response->bsp_lapic_id) {
+            continue;
+        }
+
+        u32 index = cpu_count;
+        // apEntry switches to the stack on Limine's tables, which don't map vmalloc
+        // space, the HHDM they do
+        u64 stack_phys = pmm_alloc(AP_STACK_ORDER);
+        void* stack = stack_phys != 0 ? phys_to_virt(stack_phys) : NULL;
+        if (stack == NULL || !percpu_alloc(index)) {
+            print_err(str8_lit("smp: out of memory for AP stacks\n"));
+            break;
+        }
+        Cpu* cpu = &cpus[index];
+        cpu->apic_id = info->lapic_id;
+        cpu_count++;
+        info->extra_argument = (u64)stack + KERNEL_STACK_SIZE;
+        __atomic_store_n(&info->goto_address, apEntry, __ATOMIC_RELEASE);
+
+        u64 deadline = ktime_ns() + AP_TIMEOUT_MS * NS_PER_MS;
+        while (!__atomic_load_n(&cpu->online, __ATOMIC_ACQUIRE) && ktime_ns() < deadline) {
+            cpu_relax();
+        }
+        if (!cpu->online) {
+            print_err(str8_lit("smp: an AP didn't come up\n"));
+            continue;
+        }
+        print(str8_lit("smp: cpu "));
+        print_u64(index);
+        print(str8_lit(" (apic "));
+        print_u64(cpu->apic_id);
+        print(str8_lit(") online\n"));
+    }
+
+    u32 online = 0;
+    for (u32 i = 0; i < cpu_count; i++) {
+        online += cpus[i].online;
+    }
+    print(str8_lit("smp: "));
+    print_u64(online);
+    print(str8_lit(" of "));
+    print_u64(response->cpu_count);
+    print(str8_lit(" cpus online\n"));
+}
+
+u32 smp_cpu_count() {
+    return cpu_count;
+}
+
+bool smp_cpu_online(u32 cpu_index) {
+    // the BSP runs before init_smp() marks it
+    return cpu_index == 0 || (cpu_index < cpu_count && __atomic_load_n(&cpus[cpu_index].online, __ATOMIC_ACQUIRE));
+}
+
+bool smp_run_on(u32 cpu_index, SmpFn fn, void* arg) {
+    if (cpu_index == 0 || cpu_index >= cpu_count) {
+        return false;
+    }
+    Cpu* cpu = &cpus[cpu_index];
+    if (!__atomic_load_n(&cpu->online, __ATOMIC_ACQUIRE) || __atomic_load_n(&cpu->fn, __ATOMIC_ACQUIRE) != NULL) {
+        return false;
+    }
+    cpu->arg = arg;
+    __atomic_store_n(&cpu->fn, fn, __ATOMIC_RELEASE);
+    lapic_send_ipi(cpu->apic_id, IPI_WAKE_VECTOR);
+    return true;
+}
+
+void smp_wait(u32 cpu_index) {
+    while (__atomic_load_n(&cpus[cpu_index].fn, __ATOMIC_ACQUIRE) != NULL) {
+        cpu_relax();
+    }
+}
+
+void smp_kick(u32 cpu_index) {
+    if (cpu_index < cpu_count && cpus[cpu_index].online) {
+        lapic_send_ipi(cpus[cpu_index].apic_id, IPI_WAKE_VECTOR);
+    }
+}
+
+void smp_flush_tlb(u64 virt, u64 size) {
+    if (cpu_count == 1 || size == 0) {
+        return;
+    }
+    u64 flags = irq_save();
+    // the shootdown in flight may be waiting for this CPU
+    while (!spin_trylock(&shootdown_lock)) {
+        shootdown_ack();
+        cpu_relax();
+    }
+
+    u32 self = current_cpu();
+    shootdown_address = virt;
+    shootdown_size = size;
+    for (u32 i = 0; i < cpu_count; i++) {
+        if (i != self && __atomic_load_n(&cpus[i].online, __ATOMIC_ACQUIRE)) {
+            // counted before the request is visible, so an ack can't run ahead
+            __atomic_add_fetch(&shootdown_pending, 1, __ATOMIC_RELAXED);
+            __atomic_store_n(per_cpu_ptr(shootdown_requested, i), true, __ATOMIC_RELEASE);
+            lapic_send_ipi(cpus[i].apic_id, IPI_TLB_VECTOR);
+        }
+    }
+    while (__atomic_load_n(&shootdown_pending, __ATOMIC_ACQUIRE) != 0) {
+        cpu_relax();
+    }
+
+    spin_unlock(&shootdown_lock);
+    irq_restore(flags);
+}
@@ -0,0 +1,41 @@
+#pragma once
+
+#include "types.h"
+#include <stdbool.h>
+
+#define IPI_WAKE_VECTOR 0xf0
+#define IPI_TLB_VECTOR 0xf1
+
+typedef void (*SmpFn)(void* arg);
+
+// Starts every AP Limine found, one after the other. Each gets its own kernel stack,
+// per-CPU area, GDT and TSS, loads the IDT and sets up its PAT, FPU, LAPIC and
+// clockevent before reporting in and idling. Needs the APIC, the FPU and the
+// clockevent set up on the BSP.
+void init_smp();
+
+// CPUs that were started, the BSP included. Their indices are 0 to smp_cpu_count() - 1,
+// an AP that never reported in keeps its index but can't run anything.
+u32 smp_cpu_count();
+
+// False for indices past smp_cpu_count() and for APs that never reported in
+bool smp_cpu_online(u32 cpu);
+
+// Runs fn(arg) on an idle AP, with interrupts enabled. Returns false if the CPU
+// isn't online or still busy with earlier work.
+bool smp_run_on(u32 cpu, SmpFn fn, void* arg);
+
+// Waits until the work handed to cpu has returned
+void smp_wait(u32 cpu);
+
+// Interrupts cpu so it looks for threads queued on it, and wakes it if it idles
+void smp_kick(u32 cpu);
+
+// The idle loop: runs smp_run_on() work, queued threads and stolen tasks, halts otherwise
+__attribute__((noreturn)) void smp_idle();
+
+// Drops [virt, virt + size) from the TLB of every other online CPU and waits until
+// they did, large ranges flush everything. Works with interrupts disabled, but the
+// others have to take the IPI: it can't be called holding a lock they might spin
+// on with interrupts disabled.
+void smp_flush_tlb(u64 virt, u64 size);
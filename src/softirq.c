@@ -0,0 +1,112 @@
+#include "softirq.h"
+#include "cpu.h"
+#include "percpu.h"
+#include "spinlock.h"
+#include "display.h"
+#include "utils.h"
+
+// Raising again while the softirqs run restarts them this often before the rest
+// waits for the next interrupt, so a busy device can't starve the thread it interrupted
+#define MAX_ROUNDS 8
+
+static SoftirqFn handlers[SOFTIRQ_COUNT];
+PERCPU static u32 pending;
+PERCPU static u32 hardirq_depth;
+// local_bh_disable() and running softirqs, either keeps them from starting
+PERCPU static u32 bh_disabled;
+PERCPU static u64 runs[SOFTIRQ_COUNT];
+
+static String8 names[SOFTIRQ_COUNT] = {
+    [SOFTIRQ_TIMER] = STR8_INIT("timer"),
+    [SOFTIRQ_KEYBOARD] = STR8_INIT("keyboard"),
+};
+
+void softirq_register(Softirq nr, SoftirqFn fn) {
+    handlers[nr] = fn;
+}
+
+// Interrupts are disabled around it and stay so in between the softirqs
+static void do_softirq() {
+    this_cpu_inc(bh_disabled);
+    preempt_disable();
+    for (u32 round = 0; round < MAX_ROUNDS; round++) {
+        u32 raised = this_cpu_read(pending);
+        if (raised == 0) {
+            break;
+        }
+        this_cpu_write(pending, 0);
+        if (IRQOFF_TRACE && irqoff_tracing) {
+            irqoff_trace_stop();
+        }
+        asm volatile("sti" : : : "memory");
+        while (raised != 0) {
+            u32 nr = __builtin_ctz(raised);
+            raised &= raised - 1;
+            if (handlers[nr] != NULL) {
+                handlers[nr]();
+            }
+            this_cpu_inc(runs[nr]);
+        }
+        asm volatile("cli" : : : "memory");
+        if (IRQOFF_TRACE && irqoff_tracing) {
+            irqoff_trace_start();
+        }
+    }
+    preempt_enable();
+    this_cpu_dec(bh_disabled);
+}
+
+void softirq_raise(Softirq nr) {
+    // a single instruction, an interrupt can't tear it
+    this_cpu_or(pending, 1u << nr);
+    u64 flags = irq_save();
+    if ((flags & RFLAGS_IF) && this_cpu_read(hardirq_depth) == 0 && this_cpu_read(bh_disabled) == 0) {
+        do_softirq();
+    }
+    irq_restore(flags);
+}
+
+void irq_enter() {
+    this_cpu_inc(hardirq_depth);
+}
+
+void irq_exit() {
+    this_cpu_dec(hardirq_depth);
+    // an interrupt that arrived while softirqs ran leaves them to the outer loop
+    if (this_cpu_read(pending) != 0 && this_cpu_read(bh_disabled) == 0) {
+        do_softirq();
+    }
+}
+
+void local_bh_disable() {
+    this_cpu_inc(bh_disabled);
+}
+
+void local_bh_enable() {
+    u64 flags = irq_save();
+    this_cpu_dec(bh_disabled);
+    if ((flags & RFLAGS_IF) && this_cpu_read(bh_disabled) == 0 && this_cpu_read(hardirq_depth) == 0
+        && this_cpu_read(pending) != 0) {
+        do_softirq();
+    }
+    irq_restore(flags);
+}
+
+bool in_interrupt() {
+    return this_cpu_read(hardirq_depth) != 0 || this_cpu_read(bh_disabled) != 0;
+}
+
+void softirq_print_stats() {
+    print(str8_lit("softirq:"));
+    for (u32 nr = 0; nr < SOFTIRQ_COUNT; nr++) {
+        u64 total = 0;
+        for_each_cpu(i) {
+            total += (*per_cpu_ptr(runs, i))[nr];
+        }
+        print(str8_lit(" "));
+        print(names[nr]);
+        print(str8_lit("="));
+        print_u64(total);
+    }
+    print(str8_lit("\n"));
+}
@@ -0,0 +1,36 @@
+#pragma once
+
+#include "types.h"
+#include <stdbool.h>
+
+// Deferred interrupt work. Handlers only acknowledge their device, stash what they
+// read and raise a softirq, whose function runs with interrupts enabled on the way
+// out of the interrupt, on the CPU that raised it. Softirqs don't nest and a thread
+// can't be preempted while they run.
+typedef enum Softirq {
+    SOFTIRQ_TIMER,
+    SOFTIRQ_KEYBOARD,
+    SOFTIRQ_COUNT,
+} Softirq;
+
+typedef void (*SoftirqFn)();
+
+void softirq_register(Softirq nr, SoftirqFn fn);
+
+// Safe from any context. Outside of interrupts the softirq runs right away,
+// unless interrupts or softirqs are disabled, then it waits for the next interrupt
+// exit or local_bh_enable().
+void softirq_raise(Softirq nr);
+
+// interrupt_dispatch() brackets every interrupt's handler with these, irq_exit()
+// runs whatever was raised
+void irq_enter();
+void irq_exit();
+
+// Keeps softirqs from running on this CPU, for data they share with threads
+void local_bh_disable();
+void local_bh_enable();
+
+bool in_interrupt();
+
+void softirq_print_stats();
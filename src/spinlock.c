@@ -0,0 +1,425 @@
+#include "spinlock.h"
+#include "percpu.h"
+#include "smp.h"
+#include "time.h"
+#include "display.h"
+#include "utils.h"
+#include "vmm.h"
+
+#define LOCKDEP_MAX_HELD 16
+// pause iterations, several seconds on anything current. No lock is held that long on purpose.
+#define LOCKDEP_SPIN_LIMIT (1ull << 28)
+
+typedef struct HeldLocks {
+    u32 count;
+    LockDep* locks[LOCKDEP_MAX_HELD];
+} HeldLocks;
+
+PERCPU static HeldLocks held;
+PERCPU u32 preempt_count;
+static bool failing;
+
+static void lockdep_fail(LockDep* dep, String8 message) {
+    if (!__atomic_exchange_n(&failing, true, __ATOMIC_ACQ_REL)) {
+        // the console lock may be the broken one
+        display_bust_lock();
+        print_err(str8_lit("lockdep: "));
+        print_err(message);
+        print_err(dep->name.size != 0 ? dep->name : str8_lit("(unnamed)"));
+        u32 owner = __atomic_load_n(&dep->owner, __ATOMIC_RELAXED);
+        if (owner != 0) {
+            print_err(str8_lit(", held by cpu "));
+            print_u64(owner - 1);
+        }
+        print_err(str8_lit("\n"));
+    }
+    hcf();
+}
+
+static inline void lockdep_before(LockDep* dep, bool exclusive) {
+    if (LOCKDEP && exclusive && __atomic_load_n(&dep->owner, __ATOMIC_RELAXED) == current_cpu() + 1) {
+        lockdep_fail(dep, str8_lit("recursive locking of "));
+    }
+}
+
+static inline void lockdep_spin(LockDep* dep, u64* spins) {
+    if (LOCKDEP && ++*spins == LOCKDEP_SPIN_LIMIT) {
+        lockdep_fail(dep, str8_lit("spinning for seconds on "));
+    }
+}
+
+static void lockdep_acquired(LockDep* dep, bool exclusive) {
+    if (!LOCKDEP) {
+        return;
+    }
+    u64 flags = irq_save();
+    if (exclusive) {
+        __atomic_store_n(&dep->owner, current_cpu() + 1, __ATOMIC_RELAXED);
+    }
+    HeldLocks* locks = this_cpu_ptr(held);
+    if (locks->count == LOCKDEP_MAX_HELD) {
+        lockdep_fail(dep, str8_lit("too many locks held, taking "));
+    }
+    locks->locks[locks->count++] = dep;
+    irq_restore(flags);
+}
+
+static void lockdep_release(LockDep* dep, bool exclusive) {
+    if (!LOCKDEP) {
+        return;
+    }
+    u64 flags = irq_save();
+    if (exclusive) {
+        if (__atomic_load_n(&dep->owner, __ATOMIC_RELAXED) != current_cpu() + 1) {
+            lockdep_fail(dep, str8_lit("releasing a lock this CPU doesn't hold: "));
+        }
+        __atomic_store_n(&dep->owner, 0, __ATOMIC_RELAXED);
+    }
+    // usually the last one taken, but out of order releases are legal
+    HeldLocks* locks = this_cpu_ptr(held);
+    u32 i = locks->count;
+    while (i > 0 && locks->locks[i - 1] != dep) {
+        i--;
+    }
+    if (i == 0) {
+        lockdep_fail(dep, str8_lit("releasing a lock this CPU doesn't hold: "));
+    }
+    for (; i < locks->count; i++) {
+        locks->locks[i - 1] = locks->locks[i];
+    }
+    locks->count--;
+    irq_restore(flags);
+}
+
+u32 lockdep_held_count() {
+    return this_cpu_ptr(held)->count;
+}
+
+void lockdep_assert_none_held() {
+    HeldLocks* locks = this_cpu_ptr(held);
+    if (LOCKDEP && locks->count != 0) {
+        lockdep_fail(locks->locks[locks->count - 1], str8_lit("waiting while holding "));
+    }
+}
+
+void lockdep_assert_held(LockDep* dep) {
+    if (LOCKDEP && __atomic_load_n(&dep->owner, __ATOMIC_RELAXED) != current_cpu() + 1) {
+        lockdep_fail(dep, str8_lit("expected to hold "));
+    }
+}
+
+void spin_init(Spinlock* lock, String8 name) {
+    lock->next = 0;
+    lock->serving = 0;
+    lock->dep.name = name;
+    lock->dep.owner = 0;
+}
+
+void spin_lock(Spinlock* lock) {
+    preempt_disable();
+    lockdep_before(&lock->dep, true);
+    u32 ticket = __atomic_fetch_add(&lock->next, 1, __ATOMIC_RELAXED);
+    u64 spins = 0;
+    while (__atomic_load_n(&lock->serving, __ATOMIC_ACQUIRE) != ticket) {
+        cpu_relax();
+        lockdep_spin(&lock->dep, &spins);
+    }
+    lockdep_acquired(&lock->dep, true);
+}
+
+bool spin_trylock(Spinlock* lock) {
+    preempt_disable();
+    lockdep_before(&lock->dep, true);
+    u32 serving = __atomic_load_n(&lock->serving, __ATOMIC_RELAXED);
+    u32 expected = serving;
+    // only free when nobody holds or waits for a ticket
+    if (!__atomic_compare_exchange_n(&lock->next, &expected, serving + 1, false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+        preempt_enable();
+        return false;
+    }
+    lockdep_acquired(&lock->dep, true);
+    return true;
+}
+
+void spin_unlock(Spinlock* lock) {
+    lockdep_release(&lock->dep, true);
+    // only the holder writes serving
+    __atomic_store_n(&lock->serving, lock->serving + 1, __ATOMIC_RELEASE);
+    preempt_enable();
+}
+
+u64 spin_lock_irqsave(Spinlock* lock) {
+    u64 flags = irq_save();
+    spin_lock(lock);
+    return flags;
+}
+
+void spin_unlock_irqrestore(Spinlock* lock, u64 flags) {
+    spin_unlock(lock);
+    irq_restore(flags);
+}
+
+void mcs_init(McsLock* lock, String8 name) {
+    lock->tail = NULL;
+    lock->dep.name = name;
+    lock->dep.owner = 0;
+}
+
+void mcs_lock(McsLock* lock, McsNode* node) {
+    preempt_disable();
+    lockdep_before(&lock->dep, true);
+    node->next = NULL;
+    node->locked = 1;
+    McsNode* prev = __atomic_exchange_n(&lock->tail, node, __ATOMIC_ACQ_REL);
+    if (prev != NULL) {
+        __atomic_store_n(&prev->next, node, __ATOMIC_RELEASE);
+        u64 spins = 0;
+        while (__atomic_load_n(&node->locked, __ATOMIC_ACQUIRE)) {
+            cpu_relax();
+            lockdep_spin(&lock->dep, &spins);
+        }
+    }
+    lockdep_acquired(&lock->dep, true);
+}
+
+void mcs_unlock(McsLock* lock, McsNode* node) {
+    lockdep_release(&lock->dep, true);
+    McsNode* next = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE);
+    if (next == NULL) {
+        McsNode* expected = node;
+        if (__atomic_compare_exchange_n(&lock->tail, &expected, NULL, false, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+            preempt_enable();
+            return;
+        }
+        // a waiter swapped itself in as the tail but hasn't linked itself to us yet
+        while ((next = __atomic_load_n(&node->next, __ATOMIC_ACQUIRE)) == NULL) {
+            cpu_relax();
+        }
+    }
+    __atomic_store_n(&next->locked, 0, __ATOMIC_RELEASE);
+    preempt_enable();
+}
+
+u64 mcs_lock_irqsave(McsLock* lock, McsNode* node) {
+    u64 flags = irq_save();
+    mcs_lock(lock, node);
+    return flags;
+}
+
+void mcs_unlock_irqrestore(McsLock* lock, McsNode* node, u64 flags) {
+    mcs_unlock(lock, node);
+    irq_restore(flags);
+}
+
+void rwlock_init(RwLock* lock, String8 name) {
+    lock->state = 0;
+    spin_init(&lock->writers, name);
+}
+
+void read_lock(RwLock* lock) {
+    preempt_disable();
+    // a CPU holding the write side would wait for itself
+    lockdep_before(&lock->writers.dep, true);
+    u64 spins = 0;
+    for (;;) {
+        if ((__atomic_load_n(&lock->state, __ATOMIC_RELAXED) & RWLOCK_WRITER) == 0) {
+            u32 state = __atomic_fetch_add(&lock->state, 1, __ATOMIC_ACQUIRE);
+            if ((state & RWLOCK_WRITER) == 0) {
+                break;
+            }
+            // a writer got in between, let it go first
+            __atomic_fetch_sub(&lock->state, 1, __ATOMIC_RELAXED);
+        }
+        cpu_relax();
+        lockdep_spin(&lock->writers.dep, &spins);
+    }
+    lockdep_acquired(&lock->writers.dep, false);
+}
+
+void read_unlock(RwLock* lock) {
+    lockdep_release(&lock->writers.dep, false);
+    __atomic_fetch_sub(&lock->state, 1, __ATOMIC_RELEASE);
+    preempt_enable();
+}
+
+void write_lock(RwLock* lock) {
+    spin_lock(&lock->writers);
+    // keeps new readers out, then waits for the ones inside to leave
+    __atomic_fetch_or(&lock->state, RWLOCK_WRITER, __ATOMIC_ACQUIRE);
+    u64 spins = 0;
+    while (__atomic_load_n(&lock->state, __ATOMIC_ACQUIRE) != RWLOCK_WRITER) {
+        cpu_relax();
+        lockdep_spin(&lock->writers.dep, &spins);
+    }
+}
+
+void write_unlock(RwLock* lock) {
+    __atomic_fetch_and(&lock->state, ~RWLOCK_WRITER, __ATOMIC_RELEASE);
+    spin_unlock(&lock->writers);
+}
+
+u64 read_lock_irqsave(RwLock* lock) {
+    u64 flags = irq_save();
+    read_lock(lock);
+    return flags;
+}
+
+void read_unlock_irqrestore(RwLock* lock, u64 flags) {
+    read_unlock(lock);
+    irq_restore(flags);
+}
+
+u64 write_lock_irqsave(RwLock* lock) {
+    u64 flags = irq_save();
+    write_lock(lock);
+    return flags;
+}
+
+void write_unlock_irqrestore(RwLock* lock, u64 flags) {
+    write_unlock(lock);
+    irq_restore(flags);
+}
+
+#define BENCH_MS 100
+// acquisitions between two looks at the clock
+#define BENCH_BATCH 64
+
+typedef enum BenchLock {
+    BENCH_TICKET,
+    BENCH_MCS,
+    BENCH_RWLOCK_READ,
+    BENCH_RWLOCK_WRITE,
+    BENCH_LOCKS,
+} BenchLock;
+
+typedef struct BenchCount {
+    u64 acquisitions;
+} __attribute__((aligned(CACHE_LINE_SIZE))) BenchCount;
+
+typedef struct LockBench {
+    BenchLock kind;
+    u32 ready;
+    bool go;
+    u64 end;
+    __attribute__((aligned(CACHE_LINE_SIZE))) Spinlock ticket;
+    __attribute__((aligned(CACHE_LINE_SIZE))) McsLock mcs;
+    __attribute__((aligned(CACHE_LINE_SIZE))) RwLock rwlock;
+    // what the lock protects, bounced between the CPUs like real shared data
+    __attribute__((aligned(CACHE_LINE_SIZE))) volatile u64 shared;
+    BenchCount counts[MAX_CPUS];
+} LockBench;
+
+static void bench_run(void* arg) {
+    LockBench* bench = arg;
+    __atomic_fetch_add(&bench->ready, 1, __ATOMIC_RELEASE);
+    while (!__atomic_load_n(&bench->go, __ATOMIC_ACQUIRE)) {
+        cpu_relax();
+    }
+
+    u64 acquisitions = 0;
+    McsNode node;
+    do {
+        for (u32 i = 0; i < BENCH_BATCH; i++) {
+            switch (bench->kind) {
+            case BENCH_TICKET:
+                spin_lock(&bench->ticket);
+                bench->shared++;
+                spin_unlock(&bench->ticket);
+                break;
+            case BENCH_MCS:
+                mcs_lock(&bench->mcs, &node);
+                bench->shared++;
+                mcs_unlock(&bench->mcs, &node);
+                break;
+            case BENCH_RWLOCK_READ:
+                read_lock(&bench->rwlock);
+                (void)bench->shared;
+                read_unlock(&bench->rwlock);
+                break;
+            default:
+                write_lock(&bench->rwlock);
+                bench->shared++;
+                write_unlock(&bench->rwlock);
+                break;
+            }
+        }
+        acquisitions += BENCH_BATCH;
+    } while (ktime_ns() < bench->end);
+    bench->counts[current_cpu()].acquisitions = acquisitions;
+}
+
+void lock_benchmark() {
+    LockBench* bench = vmm_alloc(sizeof(LockBench));
+    if (bench == NULL) {
+        print_err(str8_lit("lock benchmark: out of memory\n"));
+        return;
+    }
+    memset(bench, 0, sizeof(LockBench));
+    spin_init(&bench->ticket, str8_lit("bench ticket"));
+    mcs_init(&bench->mcs, str8_lit("bench mcs"));
+    rwlock_init(&bench->rwlock, str8_lit("bench rwlock"));
+
+    u32 cpus = smp_cpu_count();
+    for (BenchLock kind = 0; kind < BENCH_LOCKS; kind++) {
+        bench->kind = kind;
+        bench->ready = 0;
+        bench->go = false;
+        for (u32 cpu = 0; cpu < cpus; cpu++) {
+            bench->counts[cpu].acquisitions = 0;
+        }
+
+        u32 workers = 1;
+        for (u32 cpu = 1; cpu < cpus; cpu++) {
+            workers += smp_run_on(cpu, bench_run, bench);
+        }
+        while (__atomic_load_n(&bench->ready, __ATOMIC_ACQUIRE) < workers - 1) {
+            cpu_relax();
+        }
+        bench->end = ktime_ns() + BENCH_MS * NS_PER_MS;
+        __atomic_store_n(&bench->go, true, __ATOMIC_RELEASE);
+        bench_run(bench);
+        for (u32 cpu = 1; cpu < cpus; cpu++) {
+            smp_wait(cpu);
+        }
+
+        u64 total = 0;
+        u64 min = (u64)-1;
+        u64 max = 0;
+        for (u32 cpu = 0; cpu < cpus; cpu++) {
+            u64 count = bench->counts[cpu].acquisitions;
+            if (count == 0) {
+                continue; // not online
+            }
+            total += count;
+            min = count < min ? count : min;
+            max = count > max ? count : max;
+        }
+
+        switch (kind) {
+        case BENCH_TICKET:
+            print(str8_lit("lock: ticket     "));
+            break;
+        case BENCH_MCS:
+            print(str8_lit("lock: mcs        "));
+            break;
+        case BENCH_RWLOCK_READ:
+            print(str8_lit("lock: rwlock (r) "));
+            break;
+        default:
+            print(str8_lit("lock: rwlock (w) "));
+            break;
+        }
+        print(str8_lit("cpus="));
+        print_u64(workers);
+        print(str8_lit(" acquisitions/s="));
+        print_u64(total * 1000 / BENCH_MS);
+        // the slowest CPU against the fastest, 100% is perfectly fair
+        print(str8_lit(" fairness="));
+        print_u64(max != 0 ? min * 100 / max : 0);
+        print(str8_lit("%\n"));
+    }
+    if (LOCKDEP) {
+        print(str8_lit("lock: numbers include lockdep checks\n"));
+    }
+    vmm_free(bench, sizeof(LockBench));
+}
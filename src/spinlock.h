@@ -0,0 +1,121 @@
+#pragma once
+
+#include "types.h"
+#include "string.h"
+#include "cpu.h"
+#include "percpu.h"
+#include <stdbool.h>
+#include <stddef.h>
+
+// lockdep-lite: catches a CPU taking a lock it already holds, releasing one it
+// doesn't hold, sleeping with locks held and waiters that spin suspiciously long.
+// Build with -DLOCKDEP=0 to leave only the bookkeeping fields behind.
+#ifndef LOCKDEP
+#define LOCKDEP 1
+#endif
+
+// Locks held by the running thread, the scheduler doesn't preempt it while there are any
+extern PERCPU u32 preempt_count;
+
+static inline void preempt_disable() {
+    this_cpu_inc(preempt_count);
+}
+
+static inline void preempt_enable() {
+    this_cpu_dec(preempt_count);
+}
+
+typedef struct LockDep {
+    String8 name;
+    u32 owner; // CPU index + 1 of the exclusive holder, 0 when free, so zeroed locks are valid
+} LockDep;
+
+#define LOCKDEP_INIT(n) {.name = STR8_INIT(n), .owner = 0}
+
+// FIFO spinlock: every waiter takes a ticket and waits for its number
+typedef struct Spinlock {
+    u32 next;
+    u32 serving;
+    LockDep dep;
+} Spinlock;
+
+#define SPINLOCK_INIT(n) {.next = 0, .serving = 0, .dep = LOCKDEP_INIT(n)}
+
+void spin_init(Spinlock* lock, String8 name);
+
+void spin_lock(Spinlock* lock);
+
+bool spin_trylock(Spinlock* lock);
+
+void spin_unlock(Spinlock* lock);
+
+// For locks also taken from interrupt handlers
+u64 spin_lock_irqsave(Spinlock* lock);
+
+void spin_unlock_irqrestore(Spinlock* lock, u64 flags);
+
+// Queue lock for contended paths: each waiter spins on the locked flag of its own
+// node instead of everyone hammering the lock word. The node lives on the
+// acquirer's stack and is handed to the matching unlock.
+typedef struct McsNode {
+    struct McsNode* next;
+    u32 locked;
+} __attribute__((aligned(CACHE_LINE_SIZE))) McsNode;
+
+typedef struct McsLock {
+    McsNode* tail;
+    LockDep dep;
+} McsLock;
+
+#define MCS_LOCK_INIT(n) {.tail = NULL, .dep = LOCKDEP_INIT(n)}
+
+void mcs_init(McsLock* lock, String8 name);
+
+void mcs_lock(McsLock* lock, McsNode* node);
+
+void mcs_unlock(McsLock* lock, McsNode* node);
+
+u64 mcs_lock_irqsave(McsLock* lock, McsNode* node);
+
+void mcs_unlock_irqrestore(McsLock* lock, McsNode* node, u64 flags);
+
+// Many readers or one writer. A waiting writer keeps new readers out, writers
+// queue up in FIFO order behind their own ticket lock.
+typedef struct RwLock {
+    u32 state; // RWLOCK_WRITER | number of readers
+    Spinlock writers;
+} RwLock;
+
+#define RWLOCK_WRITER (1u << 31)
+
+#define RWLOCK_INIT(n) {.state = 0, .writers = SPINLOCK_INIT(n)}
+
+void rwlock_init(RwLock* lock, String8 name);
+
+void read_lock(RwLock* lock);
+
+void read_unlock(RwLock* lock);
+
+void write_lock(RwLock* lock);
+
+void write_unlock(RwLock* lock);
+
+u64 read_lock_irqsave(RwLock* lock);
+
+void read_unlock_irqrestore(RwLock* lock, u64 flags);
+
+u64 write_lock_irqsave(RwLock* lock);
+
+void write_unlock_irqrestore(RwLock* lock, u64 flags);
+
+// Locks the calling CPU holds right now, readers included
+u32 lockdep_held_count();
+
+// Stops with a message if the calling CPU holds any lock, for code about to wait
+void lockdep_assert_none_held();
+
+// Stops with a message unless the calling CPU holds lock exclusively
+void lockdep_assert_held(LockDep* dep);
+
+// Acquisitions per second and fairness of every lock type on all online CPUs
+void lock_benchmark();
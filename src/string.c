@@ -88,3 +88,40 @@ String8 str8_from_cstr(const char* cstr) {
     String8 ret = {(u8*)cstr, strLen};
     return ret;
 }
+
+u32 str8_decode_utf8(String8 str, u64* i) {
+    u8 byte = str.str[*i];
+    u32 length;
+    u32 codepoint;
+    if (byte < 0x80) {
+        *i += 1;
+        return byte;
+    } else if ((byte & 0xE0) == 0xC0) {
+        length = 2;
+        codepoint = byte & 0x1F;
+    } else if ((byte & 0xF0) == 0xE0) {
+        length = 3;
+        codepoint = byte & 0x0F;
+    } else if ((byte & 0xF8) == 0xF0) {
+        length = 4;
+        codepoint = byte & 0x07;
+    } else {
+        *i += 1;
+        return 0xFFFD;
+    }
+
+    if (*i + length > str.size) {
+        *i += 1;
+        return 0xFFFD;
+    }
+    for (u32 k = 1; k < length; k++) {
+        u8 next = str.str[*i + k];
+        if ((next & 0xC0) != 0x80) {
+            *i += 1;
+            return 0xFFFD;
+        }
+        codepoint = (codepoint << 6) | (next & 0x3F);
+    }
+    *i += length;
+    return codepoint;
+}
@@ -12,6 +12,9 @@ String8 str8(u8* str, u64 size);
 
 #define str8_lit(S) str8((u8*)(S), sizeof(S) - 1)
 
+// str8_lit() as a constant expression, for static initializers
+#define STR8_INIT(S) {(u8*)(S), sizeof(S) - 1}
+
 String8 u64_to_str8(u64 x, u8* buffer, u64 bufferSize);
 
 String8 u64_to_str8_hex(u64 x, u8* buffer, u64 bufferSize);
@@ -23,3 +26,7 @@ bool str8_eq(String8 a, String8 b);
 String8 str8_suffix(String8 str, u64 n);
 
 String8 str8_from_cstr(const char* cstr);
+
+// Decodes the code point starting at str.str[*i] and moves *i past it.
+// Malformed input yields U+FFFD and skips a single byte.
+u32 str8_decode_utf8(String8 str, u64* i);
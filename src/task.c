@@ -0,0 +1,277 @@
+#include "task.h"
+#include "cpu.h"
+#include "percpu.h"
+#include "spinlock.h"
+#include "smp.h"
+#include "time.h"
+#include "vmm.h"
+#include "display.h"
+#include "utils.h"
+
+typedef struct Task {
+    TaskFn fn;
+    void* arg;
+    TaskGroup* group;
+} Task;
+
+// Chase-Lev deque: the owning CPU pushes and pops at bottom without atomics in the
+// common case, thieves take from top with a CAS. Only the last task is raced for.
+// The array doesn't grow, so a slot can't be reused before top has moved past it.
+typedef struct TaskDeque {
+    i64 top;
+    i64 bottom __attribute__((aligned(CACHE_LINE_SIZE)));
+    Task tasks[TASK_DEQUE_SIZE];
+} TaskDeque;
+
+PERCPU static TaskDeque deque;
+PERCPU static u64 spawned;
+PERCPU static u64 stolen;
+PERCPU static u64 inlined;
+// CPUs halted in the idle loop that a spawn should wake
+static u64 idle_cpus;
+
+#define MASK (TASK_DEQUE_SIZE - 1)
+
+static void write_slot(Task* slot, Task* task) {
+    __atomic_store_n(&slot->fn, task->fn, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->arg, task->arg, __ATOMIC_RELAXED);
+    __atomic_store_n(&slot->group, task->group, __ATOMIC_RELAXED);
+}
+
+static void read_slot(Task* slot, Task* task) {
+    task->fn = __atomic_load_n(&slot->fn, __ATOMIC_RELAXED);
+    task->arg = __atomic_load_n(&slot->arg, __ATOMIC_RELAXED);
+    task->group = __atomic_load_n(&slot->group, __ATOMIC_RELAXED);
+}
+
+// push and pop are for the owner only, with preemption disabled so another
+// thread on the CPU can't interleave with them
+static bool push(TaskDeque* q, Task* task) {
+    i64 bottom = __atomic_load_n(&q->bottom, __ATOMIC_RELAXED);
+    i64 top = __atomic_load_n(&q->top, __ATOMIC_ACQUIRE);
+    if (bottom - top >= TASK_DEQUE_SIZE) {
+        return false;
+    }
+    write_slot(&q->tasks[bottom & MASK], task);
+    __atomic_store_n(&q->bottom, bottom + 1, __ATOMIC_RELEASE);
+    return true;
+}
+
+static bool pop(TaskDeque* q, Task* task) {
+    i64 bottom = __atomic_load_n(&q->bottom, __ATOMIC_RELAXED) - 1;
+    __atomic_store_n(&q->bottom, bottom, __ATOMIC_RELAXED);
+    // thieves have to see the smaller bottom before top is read
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    i64 top = __atomic_load_n(&q->top, __ATOMIC_RELAXED);
+    if (top > bottom) {
+        __atomic_store_n(&q->bottom, bottom + 1, __ATOMIC_RELAXED);
+        return false;
+    }
+    read_slot(&q->tasks[bottom & MASK], task);
+    if (top < bottom) {
+        return true;
+    }
+    // the last task, a thief may be after it too
+    bool won = __atomic_compare_exchange_n(&q->top, &top, top + 1, false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+    __atomic_store_n(&q->bottom, bottom + 1, __ATOMIC_RELAXED);
+    return won;
+}
+
+static bool steal(TaskDeque* q, Task* task) {
+    i64 top = __atomic_load_n(&q->top, __ATOMIC_ACQUIRE);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    i64 bottom = __atomic_load_n(&q->bottom, __ATOMIC_ACQUIRE);
+    if (top >= bottom) {
+        return false;
+    }
+    read_slot(&q->tasks[top & MASK], task);
+    return __atomic_compare_exchange_n(&q->top, &top, top + 1, false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+}
+
+static void run(Task* task) {
+    task->fn(task->arg);
+    // the group may be gone as soon as this lands
+    __atomic_fetch_sub(&task->group->pending, 1, __ATOMIC_RELEASE);
+}
+
+static void wake_idle() {
+    // pairs with task_idle_enter(): either it sees the task or this sees its bit
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    u64 idle = __atomic_load_n(&idle_cpus, __ATOMIC_RELAXED) & ~(1ull << current_cpu());
+    if (idle == 0) {
+        return;
+    }
+    u32 cpu = __builtin_ctzll(idle);
+    // whoever clears the bit sends the IPI, one spawn wakes one CPU
+    if (__atomic_fetch_and(&idle_cpus, ~(1ull << cpu), __ATOMIC_ACQ_REL) & (1ull << cpu)) {
+        smp_kick(cpu);
+    }
+}
+
+void task_spawn(TaskGroup* group, TaskFn fn, void* arg) {
+    __atomic_fetch_add(&group->pending, 1, __ATOMIC_RELAXED);
+    Task task = {fn, arg, group};
+    preempt_disable();
+    bool queued = push(this_cpu_ptr(deque), &task);
+    preempt_enable();
+    if (!queued) {
+        this_cpu_inc(inlined);
+        run(&task);
+        return;
+    }
+    this_cpu_inc(spawned);
+    wake_idle();
+}
+
+bool task_run_one() {
+    Task task;
+    preempt_disable();
+    bool found = pop(this_cpu_ptr(deque), &task);
+    preempt_enable();
+
+    // victims in order from the next CPU on, so thieves spread out
+    u32 self = current_cpu();
+    for (u32 i = 1; !found && i < percpu_cpus; i++) {
+        found = steal(per_cpu_ptr(deque, (self + i) % percpu_cpus), &task);
+        if (found) {
+            this_cpu_inc(stolen);
+        }
+    }
+    if (found) {
+        run(&task);
+    }
+    return found;
+}
+
+void task_wait(TaskGroup* group) {
+    while (__atomic_load_n(&group->pending, __ATOMIC_ACQUIRE) != 0) {
+        if (!task_run_one()) {
+            cpu_relax();
+        }
+    }
+}
+
+bool task_idle_enter() {
+    u64 bit = 1ull << current_cpu();
+    __atomic_fetch_or(&idle_cpus, bit, __ATOMIC_SEQ_CST);
+    for_each_cpu(i) {
+        TaskDeque* q = per_cpu_ptr(deque, i);
+        if (__atomic_load_n(&q->bottom, __ATOMIC_RELAXED) > __atomic_load_n(&q->top, __ATOMIC_RELAXED)) {
+            __atomic_fetch_and(&idle_cpus, ~bit, __ATOMIC_RELAXED);
+            return false;
+        }
+    }
+    return true;
+}
+
+void task_idle_exit() {
+    __atomic_fetch_and(&idle_cpus, ~(1ull << current_cpu()), __ATOMIC_RELAXED);
+}
+
+typedef struct ParallelFor {
+    ParallelForFn fn;
+    void* arg;
+    u64 next; // first item no CPU has claimed yet
+    u64 end;
+    u64 grain;
+} ParallelFor;
+
+// Claims chunks until none are left. Every helper runs this, so a CPU that shows
+// up late just finds nothing to do and chunks balance out by themselves.
+static void parallel_for_worker(void* data) {
+    ParallelFor* job = data;
+    for (;;) {
+        u64 begin = __atomic_fetch_add(&job->next, job->grain, __ATOMIC_RELAXED);
+        if (begin >= job->end) {
+            return;
+        }
+        u64 end = job->end - begin > job->grain ? begin + job->grain : job->end;
+        job->fn(begin, end, job->arg);
+    }
+}
+
+void parallel_for(u64 begin, u64 end, u64 grain, ParallelForFn fn, void* arg) {
+    if (begin >= end) {
+        return;
+    }
+    if (grain == 0) {
+        grain = 1;
+    }
+    ParallelFor job = {fn, arg, begin, end, grain};
+    u64 chunks = (end - begin - 1) / grain + 1;
+    u64 helpers = percpu_cpus - 1;
+    if (chunks - 1 < helpers) {
+        helpers = chunks - 1;
+    }
+
+    TaskGroup group = TASK_GROUP_INIT;
+    for (u64 i = 0; i < helpers; i++) {
+        task_spawn(&group, parallel_for_worker, &job);
+    }
+    parallel_for_worker(&job);
+    task_wait(&group);
+}
+
+#define BENCH_SIZE (32ull * 1024 * 1024)
+#define BENCH_GRAIN (256 * 1024)
+
+static void zero_chunk(u64 begin, u64 end, void* arg) {
+    memset((u8*)arg + begin, 0, end - begin);
+}
+
+void task_benchmark() {
+    u8* buffer = vmm_alloc(BENCH_SIZE);
+    if (buffer == NULL) {
+        print_err(str8_lit("task benchmark: out of memory\n"));
+        return;
+    }
+
+    // touched once up front, so neither pass pays for faulting the pages in
+    memset(buffer, 0xff, BENCH_SIZE);
+    u64 start = ktime_ns();
+    memset(buffer, 0, BENCH_SIZE);
+    u64 serial = ktime_ns() - start;
+
+    u64 stolen_before = 0;
+    for_each_cpu(i) {
+        stolen_before += *per_cpu_ptr(stolen, i);
+    }
+    start = ktime_ns();
+    parallel_for(0, BENCH_SIZE, BENCH_GRAIN, zero_chunk, buffer);
+    u64 parallel = ktime_ns() - start;
+    u64 steals = 0;
+    for_each_cpu(i) {
+        steals += *per_cpu_ptr(stolen, i);
+    }
+    vmm_free(buffer, BENCH_SIZE);
+
+    print(str8_lit("task: zeroing "));
+    print_u64(BENCH_SIZE / (1024 * 1024));
+    print(str8_lit(" MiB serial="));
+    print_u64(serial / 1000);
+    print(str8_lit("us parallel="));
+    print_u64(parallel / 1000);
+    print(str8_lit("us on "));
+    print_u64(percpu_cpus);
+    print(str8_lit(" cpus, "));
+    print_u64(steals - stolen_before);
+    print(str8_lit(" steals\n"));
+}
+
+void task_print_stats() {
+    u64 total_spawned = 0;
+    u64 total_stolen = 0;
+    u64 total_inlined = 0;
+    for_each_cpu(i) {
+        total_spawned += *per_cpu_ptr(spawned, i);
+        total_stolen += *per_cpu_ptr(stolen, i);
+        total_inlined += *per_cpu_ptr(inlined, i);
+    }
+    print(str8_lit("task: spawned="));
+    print_u64(total_spawned);
+    print(str8_lit(" stolen="));
+    print_u64(total_stolen);
+    print(str8_lit(" inlined="));
+    print_u64(total_inlined);
+    print(str8_lit("\n"));
+}
@@ -0,0 +1,47 @@
+#pragma once
+
+#include "types.h"
+#include <stdbool.h>
+
+// Short jobs that any CPU may run: each CPU queues the tasks it spawns on a
+// work-stealing deque, and idle or waiting CPUs take from the others. Tasks run
+// with interrupts enabled and may spawn and wait themselves, but never from an
+// interrupt handler.
+
+typedef void (*TaskFn)(void* arg);
+
+// Counts the unfinished tasks spawned into it, lives on the spawner's stack
+typedef struct TaskGroup {
+    u64 pending;
+} TaskGroup;
+
+#define TASK_GROUP_INIT {.pending = 0}
+
+// Tasks waiting on one CPU, a full deque runs further spawns inline
+#define TASK_DEQUE_SIZE 256
+
+void task_spawn(TaskGroup* group, TaskFn fn, void* arg);
+
+// Runs queued tasks, this CPU's and stolen ones, until every task of group is done
+void task_wait(TaskGroup* group);
+
+// Runs one task from this CPU or stolen from another, false if there was none.
+// The idle loop calls this.
+bool task_run_one();
+
+// Marks this CPU as halting, so the next spawn elsewhere sends it a wake IPI.
+// Returns false and leaves it unmarked if tasks are waiting somewhere.
+bool task_idle_enter();
+
+void task_idle_exit();
+
+typedef void (*ParallelForFn)(u64 begin, u64 end, void* arg);
+
+// Calls fn on chunks of at most grain items covering [begin, end), spread over
+// every CPU that comes by, and returns once all of them are done
+void parallel_for(u64 begin, u64 end, u64 grain, ParallelForFn fn, void* arg);
+
+// Zeroes a large buffer serially and with parallel_for
+void task_benchmark();
+
+void task_print_stats();
@@ -0,0 +1,151 @@
+#include "time.h"
+#include "acpi.h"
+#include "vmm.h"
+#include "pmm.h"
+#include "utils.h"
+#include "display.h"
+
+#define HPET_CAPABILITIES 0x00
+#define HPET_CONFIG 0x10
+#define HPET_COUNTER 0xf0
+#define HPET_ENABLE (1 << 0)
+#define FS_PER_NS 1000000ull
+
+#define PIT_CH2_DATA 0x42
+#define PIT_COMMAND 0x43
+// bit 0 gates channel 2, bit 1 connects it to the speaker, bit 5 reads its output
+#define PIT_CH2_CONTROL 0x61
+#define PIT_FREQUENCY 1193182
+
+#define CALIBRATION_MS 20
+#define CALIBRATION_ROUNDS 3
+
+// ns_to_cycles() = (ns * cycles_mult) >> CYCLES_SHIFT, narrower so the mult can't overflow
+#define CYCLES_SHIFT 24
+
+typedef struct __attribute__((packed)) AcpiHpet {
+    AcpiHeader header;
+    u32 event_timer_block_id;
+    u8 address_space;
+    u8 register_bit_width;
+    u8 register_bit_offset;
+    u8 reserved;
+    u64 address;
+    u8 hpet_number;
+    u16 minimum_tick;
+    u8 page_protection;
+} AcpiHpet;
+
+u64 ktime_tsc_base;
+u64 ktime_mult;
+bool has_rdtscp;
+
+static u64 tsc_hz;
+static u64 cycles_mult;
+static bool invariant;
+
+static volatile u8* hpet;
+static u64 hpet_period_fs;
+
+static bool init_hpet() {
+    AcpiHpet* table = (AcpiHpet*)acpi_find_table("HPET");
+    // only memory mapped HPETs exist in practice
+    if (table == NULL || table->address_space != 0) {
+        return false;
+    }
+    hpet = vmm_map_physical(table->address, PAGE_SIZE, PTE_CACHE_UC);
+    if (hpet == NULL) {
+        return false;
+    }
+    hpet_period_fs = *(volatile u64*)(hpet + HPET_CAPABILITIES) >> 32;
+    if (hpet_period_fs == 0) {
+        return false;
+    }
+    *(volatile u64*)(hpet + HPET_CONFIG) |= HPET_ENABLE;
+    return true;
+}
+
+// TSC cycles in one CALIBRATION_MS window of the HPET
+static u64 hpet_window() {
+    u64 ticks = CALIBRATION_MS * NS_PER_MS * FS_PER_NS / hpet_period_fs;
+    u64 start_counter = *(volatile u64*)(hpet + HPET_COUNTER);
+    u64 start = rdtsc();
+    u64 counter;
+    do {
+        counter = *(volatile u64*)(hpet + HPET_COUNTER);
+    } while (counter - start_counter < ticks);
+    u64 cycles = rdtsc() - start;
+
+    // scale to the exact window, the last read may have overshot it
+    u64 elapsed_ns = (counter - start_counter) * hpet_period_fs / FS_PER_NS;
+    return cycles * (CALIBRATION_MS * NS_PER_MS) / elapsed_ns;
+}
+
+// TSC cycles in one CALIBRATION_MS window of PIT channel 2
+static u64 pit_window() {
+    u16 count = PIT_FREQUENCY * CALIBRATION_MS / 1000;
+    u8 control = inb(PIT_CH2_CONTROL) & ~0x03;
+    outb(PIT_CH2_CONTROL, control);
+    outb(PIT_COMMAND, 0xb0); // channel 2, lobyte/hibyte, mode 0: output goes high at terminal count
+    outb(PIT_CH2_DATA, count & 0xff);
+    outb(PIT_CH2_DATA, count >> 8);
+
+    u64 start = rdtsc();
+    // counting starts with the gate going high
+    outb(PIT_CH2_CONTROL, control | 0x01);
+    while ((inb(PIT_CH2_CONTROL) & 0x20) == 0) {
+        cpu_relax();
+    }
+    return rdtsc() - start;
+}
+
+void init_time() {
+    u32 eax, ebx, ecx, edx;
+    cpuid(0x80000000, 0, &eax, &ebx, &ecx, &edx);
+    u32 max_leaf = eax;
+    if (max_leaf >= 0x80000001) {
+        cpuid(0x80000001, 0, &eax, &ebx, &ecx, &edx);
+        has_rdtscp = (edx & (1 << 27)) != 0;
+    }
+    if (max_leaf >= 0x80000007) {
+        cpuid(0x80000007, 0, &eax, &ebx, &ecx, &edx);
+        invariant = (edx & (1 << 8)) != 0;
+    }
+
+    bool use_hpet = init_hpet();
+    // the shortest window had the least interference
+    u64 flags = irq_save();
+    u64 cycles = (u64)-1;
+    for (u32 i = 0; i < CALIBRATION_ROUNDS; i++) {
+        u64 window = use_hpet ? hpet_window() : pit_window();
+        if (window < cycles) {
+            cycles = window;
+        }
+    }
+    irq_restore(flags);
+
+    tsc_hz = cycles * 1000 / CALIBRATION_MS;
+    ktime_mult = (NS_PER_SEC << KTIME_SHIFT) / tsc_hz;
+    cycles_mult = (tsc_hz << CYCLES_SHIFT) / NS_PER_SEC;
+    ktime_tsc_base = rdtsc();
+
+    print(str8_lit("time: tsc "));
+    print_u64(tsc_hz / 1000000);
+    print(use_hpet ? str8_lit(" MHz (hpet)") : str8_lit(" MHz (pit)"));
+    print(invariant ? str8_lit(", invariant\n") : str8_lit("\n"));
+    if (!invariant) {
+        print_err(str8_lit("time: the TSC isn't invariant, ktime may drift with frequency changes\n"));
+    }
+}
+
+u64 tsc_frequency() {
+    return tsc_hz;
+}
+
+bool tsc_invariant() {
+    return invariant;
+}
+
+u64 ns_to_cycles(u64 ns) {
+    return (u64)(((unsigned __int128)ns * cycles_mult) >> CYCLES_SHIFT);
+}
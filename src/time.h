@@ -0,0 +1,60 @@
+#pragma once
+
+#include "types.h"
+#include "cpu.h"
+#include <stdbool.h>
+
+#define NS_PER_US 1000ull
+#define NS_PER_MS 1000000ull
+#define NS_PER_SEC 1000000000ull
+
+// ns = (cycles * ktime_mult) >> KTIME_SHIFT
+#define KTIME_SHIFT 32
+
+extern u64 ktime_tsc_base;
+extern u64 ktime_mult;
+// set by init_time(), cycles_end() makes do with lfence; rdtsc until then
+extern bool has_rdtscp;
+
+// Calibrates the TSC against the HPET, or PIT channel 2 when there is none.
+// Needs ACPI to find the HPET.
+void init_time();
+
+u64 tsc_frequency();
+
+// An invariant TSC runs at a constant rate in every P-, C- and T-state
+bool tsc_invariant();
+
+static inline u64 cycles_to_ns(u64 cycles) {
+    return (u64)(((unsigned __int128)cycles * ktime_mult) >> KTIME_SHIFT);
+}
+
+u64 ns_to_cycles(u64 ns);
+
+// Monotonic nanoseconds since init_time(), a rdtsc and a multiply
+static inline u64 ktime_ns() {
+    return cycles_to_ns(rdtsc() - ktime_tsc_base);
+}
+
+// The TSC value at which ktime_ns() reaches ns
+static inline u64 ktime_to_tsc(u64 ns) {
+    return ktime_tsc_base + ns_to_cycles(ns);
+}
+
+// Cycle counters for benchmarks. The fences keep the measured instructions
+// from being reordered out of the window.
+static inline u64 cycles_begin() {
+    u32 low, high;
+    asm volatile("lfence; rdtsc" : "=a"(low), "=d"(high) : : "memory");
+    return ((u64)high << 32) | low;
+}
+
+static inline u64 cycles_end() {
+    u32 low, high;
+    if (has_rdtscp) {
+        asm volatile("rdtscp; lfence" : "=a"(low), "=d"(high) : : "rcx", "memory");
+    } else {
+        asm volatile("lfence; rdtsc; lfence" : "=a"(low), "=d"(high) : : "memory");
+    }
+    return ((u64)high << 32) | low;
+}
@@ -0,0 +1,318 @@
+#include "timer.h"
+#include "cpu.h"
+#include "percpu.h"
+#include "time.h"
+#include "clockevent.h"
+#include "interrupt.h"
+#include "display.h"
+#include "vmm.h"
+#include "utils.h"
+#include "spinlock.h"
+
+#define SLOT_MASK (TIMER_SLOTS - 1)
+#define MAX_DELTA (1ull << (TIMER_SLOT_BITS * TIMER_LEVELS))
+#define LEVEL_SHIFT(level) (TIMER_SLOT_BITS * (level))
+// slot of timers taken off the wheel by timer_run() whose callbacks haven't run yet
+#define EXPIRING_SLOT 0xffff
+
+// A cascading timing wheel: level 0 has one slot per tick, every level above has
+// slots 64 times as wide. Timers sit in the level their distance from now falls
+// into and move down a level each time the wheel reaches their slot.
+// Timers live on the wheel of the CPU that added them, other CPUs only come by to
+// cancel or move one. Each wheel's lock is taken with interrupts disabled.
+typedef struct TimerWheel {
+    Spinlock lock;
+    u64 now; // last tick that was processed
+    u64 occupied[TIMER_LEVELS];
+    Timer* slots[TIMER_LEVELS][TIMER_SLOTS];
+    Timer* expiring;
+    u64 pending;
+    u64 added;
+    u64 expired;
+    u64 cascaded;
+    u64 runs;
+} __attribute__((aligned(CACHE_LINE_SIZE))) TimerWheel;
+
+PERCPU static TimerWheel wheel;
+
+static inline u64 ror(u64 x, u32 n) {
+    return (x >> n) | (x << ((64 - n) & 63));
+}
+
+// earliest is the first tick that is still going to be processed: now + 1, or now
+// itself while cascading, which happens before the tick's level 0 slot expires
+static void link(Timer** head, Timer* timer) {
+    timer->next = *head;
+    if (*head != NULL) {
+        (*head)->pprev = &timer->next;
+    }
+    *head = timer;
+    timer->pprev = head;
+}
+
+static void enqueue(TimerWheel* wheel, Timer* timer, u64 earliest) {
+    u64 tick = timer->tick > earliest ? timer->tick : earliest;
+    u64 delta = tick - wheel->now;
+    if (delta >= MAX_DELTA) {
+        tick = wheel->now + MAX_DELTA - 1;
+        delta = MAX_DELTA - 1;
+    }
+
+    u32 level = 0;
+    while (delta >= 1ull << LEVEL_SHIFT(level + 1)) {
+        level++;
+    }
+    u32 index = (tick >> LEVEL_SHIFT(level)) & SLOT_MASK;
+
+    link(&wheel->slots[level][index], timer);
+    timer->slot = level * TIMER_SLOTS + index;
+    wheel->occupied[level] |= 1ull << index;
+}
+
+static void unlink(TimerWheel* wheel, Timer* timer) {
+    *timer->pprev = timer->next;
+    if (timer->next != NULL) {
+        timer->next->pprev = timer->pprev;
+    }
+    u32 level = timer->slot / TIMER_SLOTS;
+    u32 index = timer->slot % TIMER_SLOTS;
+    if (timer->slot != EXPIRING_SLOT && wheel->slots[level][index] == NULL) {
+        wheel->occupied[level] &= ~(1ull << index);
+    }
+    timer->next = NULL;
+    timer->pprev = NULL;
+}
+
+static void cascade(TimerWheel* wheel, u32 level, u32 index) {
+    Timer* timer = wheel->slots[level][index];
+    wheel->slots[level][index] = NULL;
+    wheel->occupied[level] &= ~(1ull << index);
+    while (timer != NULL) {
+        Timer* next = timer->next;
+        enqueue(wheel, timer, wheel->now);
+        wheel->cascaded++;
+        timer = next;
+    }
+}
+
+// Processes every tick up to target and moves what expired to the expiring list
+static void advance(TimerWheel* wheel, u64 target) {
+    while (wheel->now < target) {
+        // with level 0 empty nothing happens before the next cascade
+        if (wheel->occupied[0] == 0) {
+            u64 boundary = (wheel->now | SLOT_MASK) + 1;
+            if (boundary > target) {
+                wheel->now = target;
+                break;
+            }
+            wheel->now = boundary - 1;
+        }
+
+        u64 tick = ++wheel->now;
+        for (u32 level = 1; level < TIMER_LEVELS && (tick & ((1ull << LEVEL_SHIFT(level)) - 1)) == 0; level++) {
+            cascade(wheel, level, (tick >> LEVEL_SHIFT(level)) & SLOT_MASK);
+        }
+
+        u32 index = tick & SLOT_MASK;
+        Timer* timer = wheel->slots[0][index];
+        wheel->slots[0][index] = NULL;
+        wheel->occupied[0] &= ~(1ull << index);
+        while (timer != NULL) {
+            Timer* next = timer->next;
+            link(&wheel->expiring, timer);
+            timer->slot = EXPIRING_SLOT;
+            timer = next;
+        }
+    }
+}
+
+// The next tick at which a timer expires or has to cascade, 0 if the wheel is empty
+static u64 next_event(TimerWheel* wheel) {
+    u64 next = 0;
+    for (u32 level = 0; level < TIMER_LEVELS; level++) {
+        if (wheel->occupied[level] == 0) {
+            continue;
+        }
+        u64 position = (wheel->now >> LEVEL_SHIFT(level)) + 1;
+        u64 rotated = ror(wheel->occupied[level], position & SLOT_MASK);
+        u64 tick = (position + __builtin_ctzll(rotated)) << LEVEL_SHIFT(level);
+        if (next == 0 || tick < next) {
+            next = tick;
+        }
+    }
+    return next;
+}
+
+static void arm(TimerWheel* wheel) {
+    u64 next = next_event(wheel);
+    if (next != 0) {
+        clockevent_arm(next << TIMER_TICK_SHIFT);
+    }
+}
+
+void timer_init(Timer* timer, TimerFn fn, void* data) {
+    timer->next = NULL;
+    timer->pprev = NULL;
+    timer->fn = fn;
+    timer->data = data;
+}
+
+// Takes the timer off whichever wheel it is on. Only its own expiry can change
+// that concurrently, which the owner's lock holds off.
+static bool detach(Timer* timer) {
+    if (!timer_pending(timer)) {
+        return false;
+    }
+    TimerWheel* owner = per_cpu_ptr(wheel, timer->cpu);
+    spin_lock(&owner->lock);
+    bool pending = timer_pending(timer);
+    if (pending) {
+        unlink(owner, timer);
+        owner->pending--;
+    }
+    spin_unlock(&owner->lock);
+    return pending;
+}
+
+void timer_add(Timer* timer, u64 expires) {
+    u64 flags = irq_save();
+    detach(timer);
+
+    TimerWheel* local = this_cpu_ptr(wheel);
+    spin_lock(&local->lock);
+    // an empty wheel can skip the ticks it slept through
+    if (local->pending == 0) {
+        u64 now = ktime_ns() >> TIMER_TICK_SHIFT;
+        if (now > local->now) {
+            local->now = now;
+        }
+    }
+
+    timer->expires = expires;
+    // rounded up, a timer never fires early
+    timer->tick = (expires + (1ull << TIMER_TICK_SHIFT) - 1) >> TIMER_TICK_SHIFT;
+    timer->cpu = current_cpu();
+    enqueue(local, timer, local->now + 1);
+    local->pending++;
+    local->added++;
+    arm(local);
+    spin_unlock(&local->lock);
+    irq_restore(flags);
+}
+
+bool timer_cancel(Timer* timer) {
+    u64 flags = irq_save();
+    bool pending = detach(timer);
+    irq_restore(flags);
+    return pending;
+}
+
+void timer_run() {
+    TimerWheel* local = this_cpu_ptr(wheel);
+    u64 flags = spin_lock_irqsave(&local->lock);
+    local->runs++;
+    advance(local, ktime_ns() >> TIMER_TICK_SHIFT);
+    // timers stay cancelable until their callback is about to run, which happens
+    // without the lock so callbacks may add timers again, and with interrupts as
+    // the caller had them
+    while (local->expiring != NULL) {
+        Timer* timer = local->expiring;
+        unlink(local, timer);
+        local->pending--;
+        local->expired++;
+        TimerFn fn = timer->fn;
+        void* data = timer->data;
+        spin_unlock_irqrestore(&local->lock, flags);
+        fn(data);
+        flags = spin_lock_irqsave(&local->lock);
+    }
+    arm(local);
+    spin_unlock_irqrestore(&local->lock, flags);
+}
+
+#define BENCH_TIMERS 4096
+#define BENCH_SPREAD_MS 5000
+#define BENCH_EXPIRY_MS 100
+
+static void count_expired(void* data) {
+    (*(u64*)data)++;
+}
+
+void timer_benchmark() {
+    u64 size = BENCH_TIMERS * sizeof(Timer);
+    Timer* timers = vmm_alloc(size);
+    if (timers == NULL) {
+        print_err(str8_lit("timer benchmark: out of memory\n"));
+        return;
+    }
+
+    u64 fired = 0;
+    for (u64 i = 0; i < BENCH_TIMERS; i++) {
+        timer_init(&timers[i], count_expired, &fired);
+    }
+
+    // timeouts scattered over seconds, like I/O deadlines and watchdogs
+    u64 now = ktime_ns();
+    u64 start = cycles_begin();
+    for (u64 i = 0; i < BENCH_TIMERS; i++) {
+        u64 ms = (i * 2654435761u) % BENCH_SPREAD_MS + 1;
+        timer_add(&timers[i], now + ms * NS_PER_MS);
+    }
+    u64 add_cycles = (cycles_end() - start) / BENCH_TIMERS;
+
+    start = cycles_begin();
+    for (u64 i = 0; i < BENCH_TIMERS; i++) {
+        timer_cancel(&timers[i]);
+    }
+    u64 cancel_cycles = (cycles_end() - start) / BENCH_TIMERS;
+
+    // every timer expires within BENCH_EXPIRY_MS, in batches per tick
+    u64 runs_before = this_cpu_ptr(wheel)->runs;
+    now = ktime_ns();
+    for (u64 i = 0; i < BENCH_TIMERS; i++) {
+        timer_add(&timers[i], now + (i % BENCH_EXPIRY_MS + 1) * NS_PER_MS);
+    }
+    sleep(BENCH_EXPIRY_MS + 10);
+    u64 runs = this_cpu_ptr(wheel)->runs - runs_before;
+
+    for (u64 i = 0; i < BENCH_TIMERS; i++) {
+        timer_cancel(&timers[i]);
+    }
+    vmm_free(timers, size);
+
+    print(str8_lit("timer: "));
+    print_u64(BENCH_TIMERS);
+    print(str8_lit(" timers, add="));
+    print_u64(add_cycles);
+    print(str8_lit(" cancel="));
+    print_u64(cancel_cycles);
+    print(str8_lit(" cycles, "));
+    print_u64(fired);
+    print(str8_lit(" expired in "));
+    print_u64(runs);
+    print(str8_lit(" timer runs\n"));
+}
+
+void timer_print_stats() {
+    u64 added = 0;
+    u64 expired = 0;
+    u64 cascaded = 0;
+    u64 runs = 0;
+    for_each_cpu(i) {
+        TimerWheel* cpu_wheel = per_cpu_ptr(wheel, i);
+        added += cpu_wheel->added;
+        expired += cpu_wheel->expired;
+        cascaded += cpu_wheel->cascaded;
+        runs += cpu_wheel->runs;
+    }
+
+    print(str8_lit("timer: added="));
+    print_u64(added);
+    print(str8_lit(" expired="));
+    print_u64(expired);
+    print(str8_lit(" cascaded="));
+    print_u64(cascaded);
+    print(str8_lit(" runs="));
+    print_u64(runs);
+    print(str8_lit("\n"));
+}
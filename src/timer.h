@@ -0,0 +1,48 @@
+#pragma once
+
+#include "types.h"
+#include <stdbool.h>
+#include <stddef.h>
+
+typedef void (*TimerFn)(void* data);
+
+// Embedded in whatever waits for the timeout, the wheel doesn't allocate
+typedef struct Timer {
+    struct Timer* next;
+    struct Timer** pprev; // NULL while the timer isn't pending
+    u64 expires;          // ktime_ns
+    u64 tick;
+    TimerFn fn;
+    void* data;
+    u32 cpu;
+    u16 slot;             // level * TIMER_SLOTS + slot index in the wheel
+} Timer;
+
+// Wheel ticks are 2^20 ns, about a millisecond
+#define TIMER_TICK_SHIFT 20
+#define TIMER_SLOT_BITS 6
+#define TIMER_SLOTS (1 << TIMER_SLOT_BITS)
+// 64^4 ticks are about 4.9 hours, later timers wait in the last level and get re-filed
+#define TIMER_LEVELS 4
+
+void timer_init(Timer* timer, TimerFn fn, void* data);
+
+static inline bool timer_pending(Timer* timer) {
+    return timer->pprev != NULL;
+}
+
+// Fires fn from the timer softirq of this CPU once ktime_ns() reaches expires.
+// Re-adding a pending timer moves it.
+void timer_add(Timer* timer, u64 expires);
+
+// Returns false if the timer wasn't pending
+bool timer_cancel(Timer* timer);
+
+// Expires everything due on this CPU and arms the clockevent for what is left.
+// Runs as the timer softirq.
+void timer_run();
+
+// Insert/cancel cost and expiry batching with a few thousand timers, needs the timer interrupt
+void timer_benchmark();
+
+void timer_print_stats();
@@ -1,51 +1,131 @@
 #include "utils.h"
 #include <stdint.h>
 #include <stddef.h>
+#include <stdbool.h>
 
 #include "types.h"
+#include "cpu.h"
+#include "vmm.h"
+#include "display.h"
+#include "time.h"
+
+// Word accesses may be unaligned and alias anything
+typedef u64 __attribute__((may_alias, aligned(1))) unaligned_u64;
+
+// Below this size the startup cost of rep movsb/stosb loses against the word loops,
+// unless the CPU has fast short rep movsb (FSRM)
+#define REP_STRING_THRESHOLD 128
+
+// Until init_mem_routines() runs everything uses the word loops, they work on any CPU
+static MemStrategy mem_strategy = MEM_WORDS;
+static u64 rep_movsb_threshold = REP_STRING_THRESHOLD;
+
+// Keep GCC from turning the loops below back into calls to the functions they implement
+#define NO_LIBCALLS __attribute__((optimize("no-tree-loop-distribute-patterns")))
+
+NO_LIBCALLS void *memcpy(void *restrict dest, const void *restrict src, u64 n) {
+    if (mem_strategy == MEM_ERMS && n >= rep_movsb_threshold) {
+        void *d = dest;
+        asm volatile("rep movsb" : "+D"(d), "+S"(src), "+c"(n) : : "memory");
+        return dest;
+    }
 
-void *memcpy(void *restrict dest, const void *restrict src, u64 n) {
     u8 *restrict pdest = (u8 *restrict)dest;
     const u8 *restrict psrc = (const u8 *restrict)src;
-
-    for (u64 i = 0; i < n; i++) {
-        pdest[i] = psrc[i];
+    while (n >= 8) {
+        *(unaligned_u64 *)pdest = *(const unaligned_u64 *)psrc;
+        pdest += 8;
+        psrc += 8;
+        n -= 8;
+    }
+    while (n > 0) {
+        *pdest++ = *psrc++;
+        n--;
     }
 
     return dest;
 }
 
-void *memset(void *s, i32 c, u64 n) {
-    u8 *p = (u8 *)s;
+NO_LIBCALLS void *memset(void *s, i32 c, u64 n) {
+    if (mem_strategy == MEM_ERMS && n >= REP_STRING_THRESHOLD) {
+        void *d = s;
+        asm volatile("rep stosb" : "+D"(d), "+c"(n) : "a"(c) : "memory");
+        return s;
+    }
 
-    for (u64 i = 0; i < n; i++) {
-        p[i] = (u8)c;
+    u8 *p = (u8 *)s;
+    u64 pattern = (u8)c * 0x0101010101010101ull;
+    while (n >= 8) {
+        *(unaligned_u64 *)p = pattern;
+        p += 8;
+        n -= 8;
+    }
+    while (n > 0) {
+        *p++ = (u8)c;
+        n--;
     }
 
     return s;
 }
 
-void *memmove(void *dest, const void *src, u64 n) {
+NO_LIBCALLS void *memmove(void *dest, const void *src, u64 n) {
     u8 *pdest = (u8 *)dest;
     const u8 *psrc = (const u8 *)src;
 
-    if (src > dest) {
-        for (u64 i = 0; i < n; i++) {
-            pdest[i] = psrc[i];
-        }
-    } else if (src < dest) {
-        for (u64 i = n; i > 0; i--) {
-            pdest[i-1] = psrc[i-1];
+    // a forward copy is safe unless dest starts inside src
+    if (pdest <= psrc || pdest >= psrc + n) {
+        if (mem_strategy == MEM_ERMS && n >= rep_movsb_threshold) {
+            asm volatile("rep movsb" : "+D"(pdest), "+S"(psrc), "+c"(n) : : "memory");
+        } else {
+            while (n >= 8) {
+                u64 word = *(const unaligned_u64 *)psrc;
+                *(unaligned_u64 *)pdest = word;
+                pdest += 8;
+                psrc += 8;
+                n -= 8;
+            }
+            while (n > 0) {
+                *pdest++ = *psrc++;
+                n--;
+            }
         }
+        return dest;
+    }
+
+    // backwards rep movsb is slow everywhere, copy words from the end instead
+    pdest += n;
+    psrc += n;
+    while (n >= 8) {
+        pdest -= 8;
+        psrc -= 8;
+        u64 word = *(const unaligned_u64 *)psrc;
+        *(unaligned_u64 *)pdest = word;
+        n -= 8;
+    }
+    while (n > 0) {
+        *--pdest = *--psrc;
+        n--;
     }
 
     return dest;
 }
 
-i32 memcmp(const void *s1, const void *s2, u64 n) {
+NO_LIBCALLS i32 memcmp(const void *s1, const void *s2, u64 n) {
     const u8 *p1 = (const u8 *)s1;
     const u8 *p2 = (const u8 *)s2;
 
+    while (n >= 8) {
+        u64 a = *(const unaligned_u64 *)p1;
+        u64 b = *(const unaligned_u64 *)p2;
+        if (a != b) {
+            // big endian order makes the first differing byte the most significant one
+            return __builtin_bswap64(a) < __builtin_bswap64(b) ? -1 : 1;
+        }
+        p1 += 8;
+        p2 += 8;
+        n -= 8;
+    }
+
     for (u64 i = 0; i < n; i++) {
         if (p1[i] != p2[i]) {
             return p1[i] < p2[i] ? -1 : 1;
@@ -55,6 +135,89 @@ i32 memcmp(const void *s1, const void *s2, u64 n) {
     return 0;
 }
 
+void init_mem_routines() {
+    u32 eax, ebx, ecx, edx;
+    cpuid(0, 0, &eax, &ebx, &ecx, &edx);
+    if (eax < 7) {
+        return;
+    }
+
+    cpuid(7, 0, &eax, &ebx, &ecx, &edx);
+    bool erms = ebx & (1 << 9);
+    bool fsrm = edx & (1 << 4);
+    if (erms) {
+        mem_strategy = MEM_ERMS;
+        rep_movsb_threshold = fsrm ? 0 : REP_STRING_THRESHOLD;
+    }
+}
+
+MemStrategy mem_get_strategy() {
+    return mem_strategy;
+}
+
+#define BENCH_MAX_SIZE (16ull << 20)
+#define BENCH_MIN_SIZE 16
+#define BENCH_NS (10 * NS_PER_MS)
+
+// Copies size bytes over and over for BENCH_NS, returns tenths of GB/s
+static u64 benchmark_copy(u8 *dest, u8 *src, u64 size) {
+    u64 bytes = 0;
+    u64 start = ktime_ns();
+    u64 elapsed;
+    do {
+        for (u64 i = 0; i < 16; i++) {
+            memcpy(dest, src, size);
+            // keep GCC from merging the repeated copies
+            asm volatile("" : : : "memory");
+        }
+        bytes += 16 * size;
+        elapsed = ktime_ns() - start;
+    } while (elapsed < BENCH_NS);
+    // bytes per ns are GB/s
+    return bytes * 10 / elapsed;
+}
+
+static void print_rate(u64 tenths) {
+    print_u64(tenths / 10);
+    print(str8_lit("."));
+    print_u64(tenths % 10);
+}
+
+void mem_benchmark() {
+    u8 *src = vmm_alloc(BENCH_MAX_SIZE);
+    u8 *dest = vmm_alloc(BENCH_MAX_SIZE);
+    if (src == NULL || dest == NULL) {
+        print_err(str8_lit("mem benchmark: out of memory\n"));
+        vmm_free(src, src != NULL ? BENCH_MAX_SIZE : 0);
+        vmm_free(dest, dest != NULL ? BENCH_MAX_SIZE : 0);
+        return;
+    }
+    memset(src, 0x5a, BENCH_MAX_SIZE);
+    memset(dest, 0, BENCH_MAX_SIZE);
+
+    MemStrategy selected = mem_strategy;
+    print(selected == MEM_ERMS ? str8_lit("memcpy GB/s, words vs rep movsb\n") : str8_lit("memcpy GB/s, words\n"));
+    for (u64 size = BENCH_MIN_SIZE; size <= BENCH_MAX_SIZE; size *= 4) {
+        print_u64(size);
+        print(str8_lit(": "));
+        mem_strategy = MEM_WORDS;
+        print_rate(benchmark_copy(dest, src, size));
+        if (selected == MEM_ERMS) {
+            mem_strategy = MEM_ERMS;
+            print(str8_lit(" "));
+            print_rate(benchmark_copy(dest, src, size));
+        }
+        print(str8_lit("\n"));
+    }
+    mem_strategy = selected;
+
+    if (memcmp(dest, src, BENCH_MAX_SIZE) != 0) {
+        print_err(str8_lit("mem benchmark: copy mismatch\n"));
+    }
+    vmm_free(src, BENCH_MAX_SIZE);
+    vmm_free(dest, BENCH_MAX_SIZE);
+}
+
 void outb(u16 port, u8 val)
 {
     __asm__ volatile ( "outb %b0, %w1" : : "a"(val), "Nd"(port) : "memory");
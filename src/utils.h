@@ -17,6 +17,19 @@ void* memmove(void* dest, const void* src, u64 n);
 
 i32 memcmp(const void* s1, const void* s2, u64 n);
 
+typedef enum MemStrategy {
+    MEM_WORDS, // 8 byte loads and stores
+    MEM_ERMS,  // rep movsb/stosb, fast on CPUs with enhanced rep movsb
+} MemStrategy;
+
+// Picks the fastest memcpy/memset variant for this CPU
+void init_mem_routines();
+
+MemStrategy mem_get_strategy();
+
+// Sweeps memcpy from 16 B to 16 MiB and prints GB/s per variant, needs init_time()
+void mem_benchmark();
+
 void outb(u16 port, u8 val);
 
 u8 inb(u16 port);
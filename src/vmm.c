@@ -0,0 +1,622 @@
+#include "vmm.h"
+#include "pmm.h"
+#include "cpu.h"
+#include "utils.h"
+#include "display.h"
+#include "spinlock.h"
+#include "exception.h"
+#include "smp.h"
+#include "time.h"
+
+__attribute__((used, section(".limine_requests")))
+static volatile struct limine_paging_mode_request paging_mode_request = {
+    .id = LIMINE_PAGING_MODE_REQUEST_ID,
+    .revision = 0,
+    .response = NULL,
+    .mode = LIMINE_PAGING_MODE_X86_64_4LVL,
+    .max_mode = LIMINE_PAGING_MODE_X86_64_4LVL,
+    .min_mode = LIMINE_PAGING_MODE_X86_64_4LVL
+};
+
+__attribute__((used, section(".limine_requests")))
+static volatile struct limine_executable_address_request executable_address_request = {
+    .id = LIMINE_EXECUTABLE_ADDRESS_REQUEST_ID,
+    .revision = 0,
+    .response = NULL
+};
+
+// from linker.lds
+extern u8 kernel_start[];
+extern u8 text_start[];
+extern u8 text_end[];
+extern u8 rodata_start[];
+extern u8 rodata_end[];
+extern u8 data_start[];
+extern u8 data_end[];
+
+// Levels are numbered like the hardware walks them: 4 is the PML4, 1 the page table
+#define LEVEL_SHIFT(level) (PAGE_SHIFT + 9 * ((level) - 1))
+#define LEVEL_INDEX(virt, level) (((virt) >> LEVEL_SHIFT(level)) & 0x1ff)
+
+static u64* kernel_pml4;
+static u64 kernel_pml4_phys;
+static u64 nx_flag;
+static bool has_1g_pages;
+// number of leaf entries per level, [1] 4 KiB, [2] 2 MiB, [3] 1 GiB
+static u64 leaf_count[4];
+// every page table and leaf_count; translations only read
+static RwLock page_tables = RWLOCK_INIT("page tables");
+
+static u64* walk(u64 virt, u32 level, bool create) {
+    u64* table = kernel_pml4;
+    for (u32 l = 4; l > level; l--) {
+        u64* entry = &table[LEVEL_INDEX(virt, l)];
+        if ((*entry & PTE_PRESENT) == 0) {
+            if (!create) {
+                return NULL;
+            }
+            u64 phys = pmm_alloc_page();
+            if (phys == 0) {
+                return NULL;
+            }
+            memset(phys_to_virt(phys), 0, PAGE_SIZE);
+            // intermediate entries are permissive, the leaf decides
+            *entry = phys | PTE_PRESENT | PTE_WRITABLE;
+        } else if (*entry & PTE_HUGE) {
+            return NULL;
+        }
+        table = phys_to_virt(*entry & PTE_ADDR_MASK);
+    }
+    return &table[LEVEL_INDEX(virt, level)];
+}
+
+static bool map_leaf(u64 virt, u64 phys, u64 flags, u32 level) {
+    u64* entry = walk(virt, level, true);
+    if (entry == NULL) {
+        return false;
+    }
+
+    flags &= ~PTE_NX | nx_flag;
+    if (level > 1) {
+        if (flags & PTE_PAT) {
+            flags = (flags & ~PTE_PAT) | PTE_PAT_HUGE;
+        }
+        flags |= PTE_HUGE;
+    }
+
+    bool present = *entry & PTE_PRESENT;
+    *entry = (phys & PTE_ADDR_MASK) | flags | PTE_PRESENT;
+    if (present) {
+        invlpg(virt);
+    } else {
+        leaf_count[level]++;
+    }
+    return true;
+}
+
+bool vmm_map_range(u64 virt, u64 phys, u64 size, u64 flags) {
+    u64 irq = write_lock_irqsave(&page_tables);
+    bool ok = true;
+    while (size > 0) {
+        u32 level = 1;
+        if (has_1g_pages && ((virt | phys) & (PAGE_SIZE_1G - 1)) == 0 && size >= PAGE_SIZE_1G) {
+            level = 3;
+        } else if (((virt | phys) & (PAGE_SIZE_2M - 1)) == 0 && size >= PAGE_SIZE_2M) {
+            level = 2;
+        }
+
+        if (!map_leaf(virt, phys, flags, level)) {
+            ok = false;
+            break;
+        }
+
+        u64 step = 1ull << LEVEL_SHIFT(level);
+        virt += step;
+        phys += step;
+        size = size > step ? size - step : 0;
+    }
+    write_unlock_irqrestore(&page_tables, irq);
+    return ok;
+}
+
+bool vmm_map_page(u64 virt, u64 phys, u64 flags) {
+    u64 irq = write_lock_irqsave(&page_tables);
+    bool ok = map_leaf(virt, phys, flags, 1);
+    write_unlock_irqrestore(&page_tables, irq);
+    return ok;
+}
+
+void vmm_unmap_page(u64 virt) {
+    u64 irq = write_lock_irqsave(&page_tables);
+    u64* entry = walk(virt, 1, false);
+    if (entry != NULL && (*entry & PTE_PRESENT)) {
+        *entry = 0;
+        leaf_count[1]--;
+        invlpg(virt);
+    }
+    write_unlock_irqrestore(&page_tables, irq);
+}
+
+// Returns the leaf entry mapping virt and its level, or NULL if virt isn't mapped
+static u64* find_leaf(u64 virt, u32* level) {
+    u64* table = kernel_pml4;
+    for (u32 l = 4; l > 0; l--) {
+        u64* entry = &table[LEVEL_INDEX(virt, l)];
+        if ((*entry & PTE_PRESENT) == 0) {
+            return NULL;
+        }
+        if (l == 1 || (*entry & PTE_HUGE)) {
+            *level = l;
+            return entry;
+        }
+        table = phys_to_virt(*entry & PTE_ADDR_MASK);
+    }
+    return NULL;
+}
+
+bool vmm_set_caching(u64 virt, u64 size, u64 cache) {
+    u64 irq = write_lock_irqsave(&page_tables);
+    u64 end = virt + size;
+    bool ok = true;
+    virt &= ~(u64)(PAGE_SIZE - 1);
+    while (virt < end) {
+        u32 level;
+        u64* entry = find_leaf(virt, &level);
+        if (entry == NULL) {
+            ok = false;
+            break;
+        }
+
+        u64 pat = PTE_PAT;
+        u64 flags = cache;
+        if (level > 1) {
+            pat = PTE_PAT_HUGE;
+            if (flags & PTE_PAT) {
+                flags = (flags & ~PTE_PAT) | PTE_PAT_HUGE;
+            }
+        }
+        *entry = (*entry & ~(PTE_PWT | PTE_PCD | pat)) | flags;
+
+        u64 mask = (1ull << LEVEL_SHIFT(level)) - 1;
+        invlpg(virt & ~mask);
+        virt = (virt & ~mask) + mask + 1;
+    }
+    // nothing may stay cached under the old memory type
+    wbinvd();
+    write_unlock_irqrestore(&page_tables, irq);
+    return ok;
+}
+
+u64 vmm_translate(u64 virt) {
+    u64 irq = read_lock_irqsave(&page_tables);
+    u32 level;
+    u64* entry = find_leaf(virt, &level);
+    u64 phys = 0;
+    if (entry != NULL) {
+        u64 mask = (1ull << LEVEL_SHIFT(level)) - 1;
+        phys = (*entry & PTE_ADDR_MASK & ~mask) | (virt & mask);
+    }
+    read_unlock_irqrestore(&page_tables, irq);
+    return phys;
+}
+
+#define PTE_CACHE_MASK (PTE_PWT | PTE_PCD | PTE_PAT)
+
+// The memory type of a leaf, in 4 KiB page layout
+static u64 leaf_cache(u64 entry, u32 level) {
+    u64 pat = level > 1 ? PTE_PAT_HUGE : PTE_PAT;
+    return (entry & (PTE_PWT | PTE_PCD)) | ((entry & pat) ? PTE_PAT : 0);
+}
+
+// Replaces a huge leaf with a table one level down mapping the same range with the same flags
+static bool split_leaf(u64* entry, u32 level) {
+    u64 table_phys = pmm_alloc_page();
+    if (table_phys == 0) {
+        return false;
+    }
+    u64* table = phys_to_virt(table_phys);
+    u64 base = *entry & PTE_ADDR_MASK & ~((1ull << LEVEL_SHIFT(level)) - 1);
+    u64 flags = (*entry & ~PTE_ADDR_MASK) | (*entry & PTE_PAT_HUGE);
+    if (level == 2) {
+        flags &= ~(PTE_HUGE | PTE_PAT_HUGE);
+        if (*entry & PTE_PAT_HUGE) {
+            flags |= PTE_PAT;
+        }
+    }
+    for (u64 i = 0; i < 512; i++) {
+        table[i] = (base + (i << LEVEL_SHIFT(level - 1))) | flags;
+    }
+    *entry = table_phys | PTE_PRESENT | PTE_WRITABLE;
+    leaf_count[level]--;
+    leaf_count[level - 1] += 512;
+    return true;
+}
+
+void* vmm_map_physical(u64 phys, u64 size, u64 flags) {
+    u64 start = phys & ~(u64)(PAGE_SIZE - 1);
+    u64 end = (phys + size + PAGE_SIZE - 1) & ~(u64)(PAGE_SIZE - 1);
+    u64 cache = flags & PTE_CACHE_MASK;
+    bool retyped = false;
+    bool ok = true;
+    u64 irq = write_lock_irqsave(&page_tables);
+    for (u64 page = start; page < end && ok; page += PAGE_SIZE) {
+        u64 virt = hhdm_offset + page;
+        u32 level;
+        u64* entry = find_leaf(virt, &level);
+        if (entry == NULL) {
+            ok = map_leaf(virt, page, PTE_WRITABLE | PTE_GLOBAL | PTE_NX | flags, 1);
+            continue;
+        }
+        if (leaf_cache(*entry, level) == cache) {
+            continue;
+        }
+
+        // the direct map may cover MMIO with a huge WB page, only this page changes type
+        while (ok && level > 1) {
+            ok = split_leaf(entry, level);
+            invlpg(virt);
+            entry = find_leaf(virt, &level);
+        }
+        if (ok) {
+            *entry = (*entry & ~PTE_CACHE_MASK) | cache;
+            invlpg(virt);
+            retyped = true;
+        }
+    }
+    // nothing may stay cached under the old memory type
+    if (retyped) {
+        wbinvd();
+    }
+    write_unlock_irqrestore(&page_tables, irq);
+
+    if (!ok) {
+        print_err(str8_lit("vmm: out of memory for page tables in vmm_map_physical\n"));
+        return NULL;
+    }
+    if (retyped) {
+        smp_flush_tlb(hhdm_offset + start, end - start);
+    }
+    return phys_to_virt(phys);
+}
+
+// Address space is never reused, every allocation is followed by an unmapped guard page
+static u64 vmalloc_next = VMALLOC_START;
+static Spinlock vmalloc_lock = SPINLOCK_INIT("vmalloc");
+
+// vmm_reserve() ranges, also under vmalloc_lock. Faults anywhere else in vmalloc
+// space are guard page hits or use after free.
+#define MAX_RESERVATIONS 32
+
+typedef struct Reservation {
+    u64 start;
+    u64 end; // 0 for a free slot
+} Reservation;
+
+static Reservation reservations[MAX_RESERVATIONS];
+// read-only behind every reserved page that was read but not written yet
+static u64 zero_page;
+// under page_tables, like leaf_count
+static u64 demand_faults;
+static u64 zero_page_maps;
+static u64 pages_materialized;
+
+static u64 vmalloc_range(u64 size, bool reserve) {
+    u64 irq = spin_lock_irqsave(&vmalloc_lock);
+    u64 virt = vmalloc_next;
+    if (size == 0 || virt + size + PAGE_SIZE > VMALLOC_END) {
+        spin_unlock_irqrestore(&vmalloc_lock, irq);
+        return 0;
+    }
+    if (reserve) {
+        u32 slot = 0;
+        while (slot < MAX_RESERVATIONS && reservations[slot].end != 0) {
+            slot++;
+        }
+        if (slot == MAX_RESERVATIONS) {
+            spin_unlock_irqrestore(&vmalloc_lock, irq);
+            return 0;
+        }
+        reservations[slot] = (Reservation){virt, virt + size};
+    }
+    vmalloc_next += size + PAGE_SIZE;
+    spin_unlock_irqrestore(&vmalloc_lock, irq);
+    return virt;
+}
+
+void* vmm_alloc(u64 size) {
+    size = (size + PAGE_SIZE - 1) & ~(u64)(PAGE_SIZE - 1);
+    u64 virt = vmalloc_range(size, false);
+    if (virt == 0) {
+        return NULL;
+    }
+
+    for (u64 offset = 0; offset < size; offset += PAGE_SIZE) {
+        u64 phys = pmm_alloc_page();
+        if (phys == 0 || !vmm_map_page(virt + offset, phys, PTE_WRITABLE | PTE_GLOBAL | PTE_NX)) {
+            if (phys != 0) {
+                pmm_free_page(phys);
+            }
+            vmm_free((void*)virt, offset);
+            return NULL;
+        }
+    }
+    return (void*)virt;
+}
+
+void* vmm_reserve(u64 size) {
+    size = (size + PAGE_SIZE - 1) & ~(u64)(PAGE_SIZE - 1);
+    return (void*)vmalloc_range(size, true);
+}
+
+void vmm_free(void* ptr, u64 size) {
+    // from here on a fault in the range is fatal again
+    u64 irq = spin_lock_irqsave(&vmalloc_lock);
+    for (u32 slot = 0; slot < MAX_RESERVATIONS; slot++) {
+        if (reservations[slot].start == (u64)ptr) {
+            reservations[slot] = (Reservation){0, 0};
+            break;
+        }
+    }
+    spin_unlock_irqrestore(&vmalloc_lock, irq);
+
+    // Frames only go back once no CPU can reach them through its TLB anymore.
+    // Until then they are chained through their first word in the HHDM.
+    u64 frames = 0;
+    irq = write_lock_irqsave(&page_tables);
+    for (u64 offset = 0; offset < size; offset += PAGE_SIZE) {
+        u64 virt = (u64)ptr + offset;
+        u64* entry = walk(virt, 1, false);
+        if (entry == NULL || (*entry & PTE_PRESENT) == 0) {
+            continue;
+        }
+        u64 phys = *entry & PTE_ADDR_MASK;
+        *entry = 0;
+        leaf_count[1]--;
+        invlpg(virt);
+        if (phys != zero_page) {
+            *(u64*)phys_to_virt(phys) = frames;
+            frames = phys;
+        }
+    }
+    write_unlock_irqrestore(&page_tables, irq);
+
+    smp_flush_tlb((u64)ptr, size);
+    while (frames != 0) {
+        u64 next = *(u64*)phys_to_virt(frames);
+        pmm_free_page(frames);
+        frames = next;
+    }
+}
+
+static bool reserved(u64 virt) {
+    u64 irq = spin_lock_irqsave(&vmalloc_lock);
+    bool found = false;
+    for (u32 slot = 0; slot < MAX_RESERVATIONS && !found; slot++) {
+        found = virt >= reservations[slot].start && virt < reservations[slot].end;
+    }
+    spin_unlock_irqrestore(&vmalloc_lock, irq);
+    return found;
+}
+
+// Page faults in vmalloc space. Two CPUs faulting on the same page both get
+// here, the second finds the work done.
+static bool demand_fault(u64 address, u64 error) {
+    if ((error & (PF_USER | PF_RESERVED | PF_FETCH)) || !reserved(address)) {
+        return false;
+    }
+
+    u64 page = address & ~(u64)(PAGE_SIZE - 1);
+    bool write = error & PF_WRITE;
+    bool replaced = false;
+    bool ok = true;
+    u64 irq = write_lock_irqsave(&page_tables);
+    demand_faults++;
+    u32 level;
+    u64* entry = find_leaf(page, &level);
+    if (entry != NULL && (!write || (*entry & PTE_WRITABLE))) {
+        // mapped by another CPU in the meantime
+    } else if (!write) {
+        ok = map_leaf(page, zero_page, PTE_GLOBAL | nx_flag, 1);
+        zero_page_maps += ok;
+    } else {
+        u64 phys = pmm_alloc_page();
+        ok = phys != 0;
+        if (ok) {
+            memset(phys_to_virt(phys), 0, PAGE_SIZE);
+            // only the zero page is mapped read-only here
+            replaced = entry != NULL;
+            ok = map_leaf(page, phys, PTE_WRITABLE | PTE_GLOBAL | nx_flag, 1);
+            if (!ok) {
+                pmm_free_page(phys);
+            }
+        }
+        pages_materialized += ok;
+    }
+    write_unlock_irqrestore(&page_tables, irq);
+
+    // other CPUs may still read the zero page through their TLB
+    if (replaced && ok) {
+        smp_flush_tlb(page, PAGE_SIZE);
+    }
+    return ok;
+}
+
+u64 vmm_nx() {
+    return nx_flag;
+}
+
+// PAT entries: 0 WB, 1 WT, 2 UC-, 3 UC (the power-on values), 4 WC, 5 WT, 6 UC-, 7 UC
+#define PAT_VALUE 0x0007040100070406ull
+
+void init_pat() {
+    u32 eax, ebx, ecx, edx;
+    cpuid(1, 0, &eax, &ebx, &ecx, &edx);
+    if ((edx & (1 << 16)) == 0) {
+        return;
+    }
+
+    u64 irq = irq_save();
+    wbinvd();
+    wrmsr(MSR_PAT, PAT_VALUE);
+    wbinvd();
+    irq_restore(irq);
+}
+
+static void map_kernel_segment(u8* start, u8* end, u64 flags) {
+    struct limine_executable_address_response* address = executable_address_request.response;
+    u64 virt = (u64)start & ~(u64)(PAGE_SIZE - 1);
+    u64 size = (((u64)end + PAGE_SIZE - 1) & ~(u64)(PAGE_SIZE - 1)) - virt;
+    if (!vmm_map_range(virt, virt - address->virtual_base + address->physical_base, size, flags)) {
+        hcf();
+    }
+}
+
+void init_vmm(struct limine_memmap_response* memmap) {
+    if (paging_mode_request.response != NULL
+     && paging_mode_request.response->mode != LIMINE_PAGING_MODE_X86_64_4LVL) {
+        hcf();
+    }
+    if (executable_address_request.response == NULL) {
+        hcf();
+    }
+
+    u32 eax, ebx, ecx, edx;
+    cpuid(0x80000000, 0, &eax, &ebx, &ecx, &edx);
+    if (eax >= 0x80000001) {
+        cpuid(0x80000001, 0, &eax, &ebx, &ecx, &edx);
+        nx_flag = (edx & (1 << 20)) ? PTE_NX : 0;
+        has_1g_pages = (edx & (1 << 26)) != 0;
+    }
+    if (nx_flag) {
+        wrmsr(MSR_EFER, rdmsr(MSR_EFER) | EFER_NXE);
+    }
+    init_pat();
+
+    kernel_pml4_phys = pmm_alloc_page();
+    if (kernel_pml4_phys == 0) {
+        hcf();
+    }
+    kernel_pml4 = phys_to_virt(kernel_pml4_phys);
+    memset(kernel_pml4, 0, PAGE_SIZE);
+
+    // Direct map every memmap entry at the same offset Limine used, so pointers
+    // handed out so far stay valid. Entries are sorted and page granular once rounded.
+    u64 mapped_end = 0;
+    for (u64 i = 0; i < memmap->entry_count; i++) {
+        struct limine_memmap_entry* entry = memmap->entries[i];
+        u64 start = entry->base & ~(u64)(PAGE_SIZE - 1);
+        u64 end = (entry->base + entry->length + PAGE_SIZE - 1) & ~(u64)(PAGE_SIZE - 1);
+        if (start < mapped_end) {
+            start = mapped_end;
+        }
+        if (start >= end) {
+            continue;
+        }
+
+        u64 flags = PTE_WRITABLE | PTE_GLOBAL | PTE_NX;
+        if (entry->type == LIMINE_MEMMAP_FRAMEBUFFER) {
+            flags |= PTE_CACHE_UC;
+        }
+        if (!vmm_map_range(hhdm_offset + start, start, end - start, flags)) {
+            hcf();
+        }
+        mapped_end = end;
+    }
+
+    // the kernel image gets the permissions of its PHDRs
+    map_kernel_segment(kernel_start, text_start, PTE_WRITABLE | PTE_GLOBAL | PTE_NX);
+    map_kernel_segment(text_start, text_end, PTE_GLOBAL);
+    map_kernel_segment(rodata_start, rodata_end, PTE_GLOBAL | PTE_NX);
+    map_kernel_segment(data_start, data_end, PTE_WRITABLE | PTE_GLOBAL | PTE_NX);
+
+    zero_page = pmm_alloc_page();
+    if (zero_page == 0) {
+        hcf();
+    }
+    memset(phys_to_virt(zero_page), 0, PAGE_SIZE);
+    page_fault_register(VMALLOC_START, VMALLOC_END, demand_fault);
+
+    write_cr3(kernel_pml4_phys);
+    // toggling PGE also drops the global entries left over from the bootloader tables
+    u64 cr4 = read_cr4();
+    write_cr4(cr4 & ~(u64)CR4_PGE);
+    write_cr4(cr4 | CR4_PGE);
+}
+
+void init_vmm_cpu() {
+    // NX bits in the kernel tables are reserved bits until NXE is set
+    if (nx_flag) {
+        wrmsr(MSR_EFER, rdmsr(MSR_EFER) | EFER_NXE);
+    }
+    init_pat();
+    write_cr3(kernel_pml4_phys);
+    write_cr4(read_cr4() | CR4_PGE);
+}
+
+#define BENCH_SIZE (64ull * 1024 * 1024)
+#define BENCH_PAGES (BENCH_SIZE / PAGE_SIZE)
+// only part of the reservation gets written, the rest stays on the zero page
+#define BENCH_WRITTEN_PAGES (BENCH_PAGES / 4)
+
+void vmm_benchmark() {
+    u64 start = cycles_begin();
+    void* eager = vmm_alloc(BENCH_SIZE);
+    u64 alloc_cycles = cycles_end() - start;
+    vmm_free(eager, eager != NULL ? BENCH_SIZE : 0);
+
+    start = cycles_begin();
+    u8* lazy = vmm_reserve(BENCH_SIZE);
+    u64 reserve_cycles = cycles_end() - start;
+    if (eager == NULL || lazy == NULL) {
+        print_err(str8_lit("vmm benchmark: out of memory\n"));
+        vmm_free(lazy, lazy != NULL ? BENCH_SIZE : 0);
+        return;
+    }
+
+    u64 materialized_before = pages_materialized;
+    start = cycles_begin();
+    for (u64 page = 0; page < BENCH_PAGES; page++) {
+        (void)*(volatile u8*)(lazy + page * PAGE_SIZE);
+    }
+    u64 read_cycles = (cycles_end() - start) / BENCH_PAGES;
+
+    start = cycles_begin();
+    for (u64 page = 0; page < BENCH_WRITTEN_PAGES; page++) {
+        *(volatile u8*)(lazy + page * PAGE_SIZE) = 1;
+    }
+    u64 write_cycles = (cycles_end() - start) / BENCH_WRITTEN_PAGES;
+    u64 backed = pages_materialized - materialized_before;
+    vmm_free(lazy, BENCH_SIZE);
+
+    print(str8_lit("vmm: "));
+    print_u64(BENCH_SIZE / (1024 * 1024));
+    print(str8_lit(" MiB vmm_alloc="));
+    print_u64(alloc_cycles);
+    print(str8_lit(" vmm_reserve="));
+    print_u64(reserve_cycles);
+    print(str8_lit(" cycles, read fault="));
+    print_u64(read_cycles);
+    print(str8_lit(" write fault="));
+    print_u64(write_cycles);
+    print(str8_lit(" cycles, "));
+    print_u64(backed);
+    print(str8_lit(" of "));
+    print_u64(BENCH_PAGES);
+    print(str8_lit(" pages backed\n"));
+}
+
+void vmm_print_stats() {
+    print(str8_lit("vmm: page table leaves 1GiB="));
+    print_u64(leaf_count[3]);
+    print(str8_lit(" 2MiB="));
+    print_u64(leaf_count[2]);
+    print(str8_lit(" 4KiB="));
+    print_u64(leaf_count[1]);
+    print(str8_lit("\nvmm: demand faults="));
+    print_u64(demand_faults);
+    print(str8_lit(" zero page maps="));
+    print_u64(zero_page_maps);
+    print(str8_lit(" pages materialized="));
+    print_u64(pages_materialized);
+    print(str8_lit("\n"));
+}
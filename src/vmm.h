@@ -0,0 +1,83 @@
+#pragma once
+
+#include "types.h"
+#include "limine.h"
+#include <stdbool.h>
+
+#define PTE_PRESENT (1ull << 0)
+#define PTE_WRITABLE (1ull << 1)
+#define PTE_USER (1ull << 2)
+#define PTE_PWT (1ull << 3)
+#define PTE_PCD (1ull << 4)
+#define PTE_ACCESSED (1ull << 5)
+#define PTE_DIRTY (1ull << 6)
+#define PTE_HUGE (1ull << 7)
+#define PTE_GLOBAL (1ull << 8)
+#define PTE_NX (1ull << 63)
+#define PTE_ADDR_MASK 0x000ffffffffff000ull
+
+// Mapping flags are always given in 4 KiB page layout, where the PAT bit is bit 7.
+// Huge page mappings move it to bit 12 themselves.
+#define PTE_PAT (1ull << 7)
+#define PTE_PAT_HUGE (1ull << 12)
+
+// Memory types, as selected through the PAT programmed by init_pat(). Entries 0-3
+// keep their power-on meaning so plain PWT/PCD mappings behave as usual.
+#define PTE_CACHE_WB 0
+#define PTE_CACHE_UC (PTE_PCD | PTE_PWT)
+#define PTE_CACHE_WC PTE_PAT
+
+#define PAGE_SIZE_2M (1ull << 21)
+#define PAGE_SIZE_1G (1ull << 30)
+
+void init_vmm(struct limine_memmap_response* memmap);
+
+// Has to run on every CPU, the PAT is per logical processor
+void init_pat();
+
+// Moves an AP from the bootloader's page tables onto the kernel's
+void init_vmm_cpu();
+
+// Maps [virt, virt + size) to [phys, phys + size) with the largest pages the alignment allows
+bool vmm_map_range(u64 virt, u64 phys, u64 size, u64 flags);
+
+bool vmm_map_page(u64 virt, u64 phys, u64 flags);
+
+void vmm_unmap_page(u64 virt);
+
+// Changes the memory type (one of PTE_CACHE_*) of every page mapping [virt, virt + size)
+bool vmm_set_caching(u64 virt, u64 size, u64 cache);
+
+// Returns the physical address virt is mapped to, or 0 if it isn't mapped
+u64 vmm_translate(u64 virt);
+
+// Makes [phys, phys + size) reachable through the HHDM, for tables and MMIO outside
+// the memmap. Pages the direct map already covers get the memory type in flags,
+// huge pages are split so only the requested range changes. NULL when out of memory.
+void* vmm_map_physical(u64 phys, u64 size, u64 flags);
+
+// Virtually contiguous kernel memory backed by individual pages, for buffers
+// too large to get physically contiguous from the buddy allocator
+#define VMALLOC_START 0xffffc00000000000ull
+#define VMALLOC_END 0xffffe00000000000ull
+
+void* vmm_alloc(u64 size);
+
+// Unmaps the range on every CPU before its frames are freed, so the same
+// smp_flush_tlb() rules apply: no locks other CPUs spin on with interrupts off
+void vmm_free(void* ptr, u64 size);
+
+// Demand paged vmm_alloc for big buffers that may stay mostly unused: only takes
+// address space, each page gets a zeroed frame on its first write. Reads before
+// that map a shared zero page, replacing it shoots it down on the other CPUs
+// with smp_flush_tlb(). Freed with vmm_free().
+void* vmm_reserve(u64 size);
+
+// PTE_NX if the CPU supports no-execute pages, 0 otherwise
+u64 vmm_nx();
+
+// vmm_alloc against vmm_reserve, and the cost of read and write faults on a
+// reservation, needs init_interrupts()
+void vmm_benchmark();
+
+void vmm_print_stats();